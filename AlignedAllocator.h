@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+
+#include "Assert.h"
+#include "GrowingMemoryPool.h"
+
+namespace MZ
+{
+    // 4096 aligned blocks for NO_BUFFERING / O_DIRECT, released blocks are cached and reused
+    class AlignedBufferPool
+    {
+        struct Block
+        {
+            void* ptr;
+
+            size_t size;
+        };
+
+        std::mutex mtx;
+
+        std::vector<Block> free;
+
+        size_t cached = 0, cacheLimit;
+
+    public:
+
+        static constexpr size_t Alignment = 4096, Granularity = 64 * 1024;
+
+        explicit AlignedBufferPool(size_t cacheLimit = 512ull * 1024 * 1024) : cacheLimit(cacheLimit) {}
+
+        ~AlignedBufferPool()
+        {
+            Trim(0);
+        }
+
+        // не разрушается при выходе, буферы глобальных объектов могут пережить пул
+        static AlignedBufferPool& Instance()
+        {
+            static auto pool = new AlignedBufferPool(); return *pool;
+        }
+
+        static size_t RoundUp(size_t size)
+        {
+            return (size == 0) ? Granularity : (size + Granularity - 1) & ~(Granularity - 1);
+        }
+
+        // size is rounded up to Granularity, a cached block of the same size is reused
+        void* Allocate(size_t size)
+        {
+            size = RoundUp(size);
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+
+                for (auto it = free.rbegin(); it != free.rend(); ++it)
+                {
+                    if (it->size != size) continue;
+
+                    const auto ptr = it->ptr; free.erase(std::next(it).base()); cached -= size; return ptr;
+                }
+            }
+
+            auto type = PageSourceType::Virtual;
+
+            return PageSource::Allocate(size, type);
+        }
+
+        void Free(void* ptr, size_t size)
+        {
+            if (ptr == nullptr) return;
+
+            mz_assert((reinterpret_cast<uintptr_t>(ptr) % Alignment) == 0);
+
+            size = RoundUp(size);
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+
+                if (cached + size <= cacheLimit)
+                {
+                    free.push_back({ ptr, size }); cached += size; return;
+                }
+            }
+
+            PageSource::Free(ptr, size, PageSourceType::Virtual);
+        }
+
+        // releases cached blocks down to keep bytes, oldest first
+        void Trim(size_t keep = 0)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+
+            size_t i = 0;
+
+            for (; i < free.size() && cached > keep; i++)
+            {
+                PageSource::Free(free[i].ptr, free[i].size, PageSourceType::Virtual); cached -= free[i].size;
+            }
+
+            free.erase(free.begin(), free.begin() + i);
+        }
+
+        size_t Cached() const
+        {
+            return cached;
+        }
+
+        AlignedBufferPool(const AlignedBufferPool&) = delete;
+        AlignedBufferPool& operator=(const AlignedBufferPool&) = delete;
+    };
+
+    template <typename T>
+    class AlignedAllocator
+    {
+    public:
+
+        using value_type = T;
+
+        AlignedAllocator() noexcept = default;
+
+        template <typename U>
+        AlignedAllocator(const AlignedAllocator<U>&) noexcept {}
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(AlignedBufferPool::Instance().Allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, size_t n) noexcept
+        {
+            AlignedBufferPool::Instance().Free(ptr, n * sizeof(T));
+        }
+
+        template <typename U>
+        bool operator==(const AlignedAllocator<U>&) const noexcept { return true; }
+
+        template <typename U>
+        bool operator!=(const AlignedAllocator<U>&) const noexcept { return false; }
+    };
+
+    // data() is 4096 aligned, File::Read/Write with NoBuffering accept it as is
+    template <typename T>
+    using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+}
@@ -3,6 +3,7 @@
 #include <vector>
 #include <cstdint>
 #include <algorithm>
+#include <intrin.h>
 
 class DeltaCompressor
 {
@@ -58,36 +59,91 @@ public:
         return overflow;
     }
 
-    static void Decode(std::vector<uint32_t>& input, std::vector<uint32_t>& overflow)
+    // overflow - сброс сегмента: там лежит исходное значение, от него считается следующая разность
+    // нули не кодируются и prev не меняют
+    static void DecodeScalar(std::vector<uint32_t>& input, const std::vector<uint32_t>& overflow)
     {
-        overflow.push_back(UINT_MAX);
+        uint32_t prev = 0, pos = FirstValue(input, prev), input_size = static_cast<uint32_t>(input.size());
 
-        uint32_t prev = 0, pos = 0, input_size = static_cast<uint32_t>(input.size());
+        size_t overflow_pos = 0;
 
-        for (pos = 0; pos < input_size; pos++)
+        for (; pos < input_size; pos++) 
         {
-            prev = input[pos];
-
-            if (prev)
+            if (overflow_pos < overflow.size() && pos == overflow[overflow_pos])
             {
-                pos++; break;
+                prev = input[pos]; overflow_pos++;
+            }
+            else if (input[pos])
+            {
+                prev = input[pos] = prev + static_cast<uint32_t>(ZigZagDecode(input[pos]));
             }
         }
+    }
+
+    // AVX2: zigzag и prefix sum по 8 значений между позициями overflow, хвосты сегментов - DecodeScalar-цикл
+    static void Decode(std::vector<uint32_t>& input, const std::vector<uint32_t>& overflow)
+    {
+        uint32_t prev = 0, pos = FirstValue(input, prev), input_size = static_cast<uint32_t>(input.size());
+
+        const auto zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1);
+
+        const auto lane3 = _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3), lane7 = _mm256_set1_epi32(7);
 
         size_t overflow_pos = 0;
 
-        for (; pos < input_size; pos++) 
+        while (overflow_pos < overflow.size() && overflow[overflow_pos] < pos) overflow_pos++;
+
+        while (pos < input_size)
         {
-            if (pos != overflow[overflow_pos])
+            const uint32_t segment_end = (overflow_pos < overflow.size()) ? overflow[overflow_pos] : input_size;
+
+            auto vprev = _mm256_set1_epi32(static_cast<int32_t>(prev));
+
+            for (; pos + 8 <= segment_end; pos += 8)
             {
-                prev = input[pos] = static_cast<int64_t>(prev) + ZigZagDecode(input[pos]);
+                const auto encoded = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input.data() + pos));
+
+                auto v = _mm256_xor_si256(_mm256_srli_epi32(encoded, 1), _mm256_sub_epi32(zero, _mm256_and_si256(encoded, one)));
+
+                v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4)); v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+
+                v = _mm256_add_epi32(v, _mm256_blend_epi32(zero, _mm256_permutevar8x32_epi32(v, lane3), 0xF0));
+
+                v = _mm256_add_epi32(v, vprev); vprev = _mm256_permutevar8x32_epi32(v, lane7);
+
+                // нули остаются нулями, их delta 0 и так не влияет на сумму
+                v = _mm256_andnot_si256(_mm256_cmpeq_epi32(encoded, zero), v);
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(input.data() + pos), v);
+            }
+
+            prev = static_cast<uint32_t>(_mm256_cvtsi256_si32(vprev));
+
+            for (; pos < segment_end; pos++)
+            {
+                if (input[pos]) prev = input[pos] = prev + static_cast<uint32_t>(ZigZagDecode(input[pos]));
             }
-            else
+
+            if (pos < input_size)
+            {
+                prev = input[pos++]; overflow_pos++;
+            }
+        }
+    }
+
+private:
+
+    // первое ненулевое значение пишется как есть, возвращает позицию за ним
+    static uint32_t FirstValue(const std::vector<uint32_t>& input, uint32_t& prev)
+    {
+        for (uint32_t pos = 0; pos < input.size(); pos++)
+        {
+            if (input[pos])
             {
-                overflow_pos++;
+                prev = input[pos]; return pos + 1;
             }
         }
 
-        overflow.resize(overflow.size() - 1);
+        return static_cast<uint32_t>(input.size());
     }
 };
@@ -3,8 +3,10 @@
 #include <functional>
 #include <queue>
 #include <execution>
+#include <cstring>
 
 #include "FileSystem.h"
+#include "AlignedAllocator.h"
 
 #ifdef max
 #undef max
@@ -24,13 +26,199 @@ namespace MZ
         return ((1ull << (std::max(12u, power_of_two_in_x))) * (x >> power_of_two_in_x)) / x;
     }
 
-    template <typename TRecord>
+    // TCodec: MaxSize, Reset(), Encode(record, out) -> end, Decode(in, record) -> end
+    // закодированная запись никогда не начинается с 0, нули добивают поток до 4096 и сбрасывают кодек
+    template <typename TRecord, typename TCodec>
+    class EncodedRecordWriter
+    {
+        File* _file = nullptr;
+
+        AlignedVector<uint8_t> _buffer;
+
+        size_t _size = 0;
+
+        int64_t _offset = 0; // смещение _buffer[0] в файле
+
+        TCodec _codec;
+
+        void WritePages()
+        {
+            const auto pages = _size & ~size_t(4095);
+
+            _file->SeekBegin(_offset); _file->Write(_buffer.data(), pages);
+
+            _offset += pages; _size -= pages;
+
+            std::memmove(_buffer.data(), _buffer.data() + pages, _size);
+        }
+
+    public:
+
+        void Open(File& file, int64_t offset, size_t bufferSize)
+        {
+            assert((offset % 4096) == 0 && bufferSize >= 4096 + TCodec::MaxSize);
+
+            _file = &file; _offset = offset; _size = 0; _codec.Reset();
+
+            _buffer.resize((bufferSize + 4095) & ~size_t(4095));
+        }
+
+        void Put(const TRecord& record)
+        {
+            if (_buffer.size() - _size < TCodec::MaxSize) WritePages();
+
+            _size = _codec.Encode(record, _buffer.data() + _size) - _buffer.data();
+        }
+
+        // ends the stream with at least one zero byte, returns the 4096 aligned end offset
+        int64_t Close()
+        {
+            if (_size == _buffer.size()) WritePages();
+
+            const auto padded = (_size + 1 + 4095) & ~size_t(4095);
+
+            std::fill(_buffer.data() + _size, _buffer.data() + padded, uint8_t(0));
+
+            _size = padded; WritePages(); _codec.Reset();
+
+            return _offset;
+        }
+
+        int64_t Offset() const
+        {
+            return _offset + _size;
+        }
+    };
+
+    // the next block is read asynchronously while the current one is decoded
+    // readers of different runs may share one File, completions are routed by tag
+    template <typename TRecord, typename TCodec>
+    class EncodedRecordReader
+    {
+        File* _file = nullptr;
+
+        // [4096 под хвост предыдущего блока | блок], пока декодируем один буфер, второй читается
+        AlignedVector<uint8_t> _buffer[2];
+
+        uint32_t _current = 0;
+
+        size_t _pos = 0, _end = 0;
+
+        int64_t _next = 0, _limit = 0;
+
+        int32_t _pending = 0, _result = 0; // размер запроса в полете
+
+        bool _bReady = false;
+
+        TCodec _codec;
+
+        static void OnComplete(uint64_t tag, int32_t result)
+        {
+            auto reader = reinterpret_cast<EncodedRecordReader*>(tag);
+
+            reader->_result = result; reader->_bReady = true;
+        }
+
+        void Submit()
+        {
+            if (_next >= _limit) return;
+
+            auto& buffer = _buffer[_current ^ 1];
+
+            _pending = static_cast<int32_t>(std::min<int64_t>(buffer.size() - 4096, _limit - _next)); _bReady = false;
+
+            while (!_file->SubmitRead(buffer.data() + 4096, _pending, _next, reinterpret_cast<uint64_t>(this)))
+            {
+                _file->Complete(OnComplete);
+            }
+
+            _next += _pending;
+        }
+
+        void Refill()
+        {
+            while (!_bReady) _file->Complete(OnComplete);
+
+            mz_assert(_result == _pending, "offset: %lld, size: %d, result: %d\n", _next - _pending, _pending, _result);
+
+            const auto tail = _end - _pos;
+
+            auto& buffer = _buffer[_current ^ 1];
+
+            std::memcpy(buffer.data() + 4096 - tail, _buffer[_current].data() + _pos, tail);
+
+            _current ^= 1; _pos = 4096 - tail; _end = 4096 + _pending; _pending = 0;
+
+            Submit();
+        }
+
+        // буфер занят, пока запрос в полете
+        void Drain()
+        {
+            while (_pending && !_bReady) _file->Complete(OnComplete);
+
+            _pending = 0;
+        }
+
+    public:
+
+        ~EncodedRecordReader()
+        {
+            Drain();
+        }
+
+        // [begin, end) must be 4096 aligned, as written by EncodedRecordWriter
+        void Open(File& file, int64_t begin, int64_t end, size_t blockSize)
+        {
+            static_assert(TCodec::MaxSize < 4096, "TCodec::MaxSize >= 4096");
+
+            assert((begin % 4096) == 0 && (end % 4096) == 0);
+
+            Drain();
+
+            _file = &file; _next = begin; _limit = end; _codec.Reset();
+
+            const auto size = 4096 + ((std::max(blockSize, TCodec::MaxSize) + 4095) & ~size_t(4095));
+
+            _buffer[0].resize(size); _buffer[1].resize(size);
+
+            _current = 0; _pos = _end = 4096;
+
+            Submit();
+        }
+
+        bool Next(TRecord& record)
+        {
+            while (true)
+            {
+                if (_end - _pos < TCodec::MaxSize && _pending) Refill();
+
+                if (_pos == _end) return false;
+
+                if (_buffer[_current][_pos] != 0) break;
+
+                while (_pos < _end && _buffer[_current][_pos] == 0) _pos++;
+
+                _codec.Reset();
+            }
+
+            _pos = _codec.Decode(_buffer[_current].data() + _pos, record) - _buffer[_current].data();
+
+            return true;
+        }
+    };
+
+    // TCodec == void: fixed size records, ChunkSort rewrites chunks in place
+    // TCodec != void: the input is an encoded stream, sorted chunks are written as encoded runs
+    template <typename TRecord, typename TCodec = void>
     class ExternalStructSort
     {
         static_assert(alignof(TRecord) == 1, "alignof(TRecord) != 1");
 
         static_assert(sizeof(TRecord) % 2 == 0, "sizeof(TRecord) % 2 != 0");
 
+        static constexpr bool bEncoded = !std::is_void_v<TCodec>;
+
         size_t _memoryLimit, _chunkSize, _numChunks, _preloadSize;
 
         const size_t _minChunkSize = find_aligment_for_4096(sizeof(TRecord));
@@ -65,11 +253,81 @@ namespace MZ
             uint32_t offset = 0;
             uint32_t raw_data_size = 0;
 
-            std::vector<TRecord> records;
+            int64_t run_begin = 0, run_end = 0; // TCodec, смещения run в файле
+
+            AlignedVector<TRecord> records;
         };
 
         std::vector<ChunkInfo> _chunkInfo;
 
+        // буфер чтения/записи закодированного потока
+        size_t EncodedBlockSize() const
+        {
+            return std::max<size_t>(_preloadSize * sizeof(TRecord), 256 * 1024);
+        }
+
+        void SortChunk(AlignedVector<TRecord>& records, std::vector<uint32_t>& indices, const std::function<void(TRecord& record)>& preSortAction)
+        {
+            if (preSortAction)
+            {
+                for (auto& record : records)
+                {
+                    preSortAction(record);
+                }
+            }
+
+            indices.resize(records.size()); std::iota(indices.begin(), indices.end(), 0);
+
+            std::sort(std::execution::par, indices.begin(), indices.end(),
+                [&](const uint32_t a, const uint32_t b)
+                {
+                    return _a_is_less_than_b(records[a], records[b]);
+                }
+            );
+        }
+
+        void ChunkSortEncoded(File& input, File* runs, const std::function<void(TRecord& record)>& preSortAction, const std::function<void(TRecord& record)>& afterSortAction)
+        {
+            AlignedVector<TRecord> records;
+
+            std::vector<uint32_t> indices;
+
+            EncodedRecordReader<TRecord, TCodec> reader; reader.Open(input, 0, input.Size(), EncodedBlockSize());
+
+            EncodedRecordWriter<TRecord, TCodec> writer; if (runs) writer.Open(*runs, 0, EncodedBlockSize());
+
+            for (auto& ci : _chunkInfo)
+            {
+                records.resize(ci.raw_data_size);
+
+                for (auto& record : records)
+                {
+                    mz_assert(reader.Next(record));
+                }
+
+                SortChunk(records, indices, preSortAction);
+
+                if (afterSortAction)
+                {
+                    for (const auto value : indices)
+                    {
+                        afterSortAction(records[value]);
+                    }
+
+                    continue;
+                }
+
+                ci.run_begin = writer.Offset();
+
+                for (const auto value : indices)
+                {
+                    writer.Put(records[value]);
+                }
+
+                ci.run_end = writer.Close();
+            }
+        }
+
     public:
 
         ExternalStructSort(size_t fileSize, const std::function<bool(const TRecord& a, const TRecord& b)>& a_is_less_than_b, size_t memoryLimit = 256 * 1024 * 1024)
@@ -82,7 +340,8 @@ namespace MZ
 
             size_t numRecords = fileSize / sizeof(TRecord);
 
-            assert(numRecords >= _minChunkSize && (numRecords % _minChunkSize) == 0);
+            // закодированный поток режется на чанки по числу записей, выравнивание не нужно
+            assert(numRecords != 0 && (bEncoded || (numRecords >= _minChunkSize && (numRecords % _minChunkSize) == 0)));
 
             _chunkSize = numRecords; _numChunks = 1; _preloadSize = _minChunkSize;
 
@@ -107,9 +366,9 @@ namespace MZ
                 }
             }
 
-            assert((_chunkSize % _minChunkSize) == 0);
+            assert(bEncoded || (_chunkSize % _minChunkSize) == 0);
 
-            assert(((numRecords % _chunkSize) % _minChunkSize) == 0);
+            assert(bEncoded || ((numRecords % _chunkSize) % _minChunkSize) == 0);
 
             _chunkInfo.resize(_numChunks);
 
@@ -126,19 +385,27 @@ namespace MZ
             }
         }
 
+        // TCodec: only with afterSortAction, sorted chunks are not written back
         void ChunkSort(File& file, const std::function<void(TRecord& record)>& preSortAction = nullptr, const std::function<void(TRecord& record)>& afterSortAction = nullptr)
         {
+            if constexpr (bEncoded)
+            {
+                assert(afterSortAction != nullptr);
+
+                ChunkSortEncoded(file, nullptr, preSortAction, afterSortAction); return;
+            }
+
             size_t numRecords = 0;
 
             for (const auto& ci : _chunkInfo) numRecords += ci.raw_data_size;
             
             assert(file.Size() / sizeof(TRecord) == numRecords);
 
-            std::vector<TRecord> records(_chunkSize);
+            AlignedVector<TRecord> records(_chunkSize);
 
             std::vector<uint32_t> indices;
 
-            std::vector<TRecord> writeRecords;
+            AlignedVector<TRecord> writeRecords; writeRecords.reserve(_preloadSize);
 
             file.SeekBegin(0);
 
@@ -150,22 +417,7 @@ namespace MZ
 
                 assert((records.size() % _minChunkSize) == 0);
 
-                if (preSortAction)
-                {
-                    for (auto& record : records)
-                    {
-                        preSortAction(record);
-                    }
-                }
-
-                indices.resize(records.size()); std::iota(indices.begin(), indices.end(), 0);
-
-                std::sort(std::execution::par, indices.begin(), indices.end(),
-                    [&](const uint32_t a, const uint32_t b)
-                    {
-                        return _a_is_less_than_b(records[a], records[b]);
-                    }
-                );
+                SortChunk(records, indices, preSortAction);
 
                 if (afterSortAction) // только сортировка без записи в файл
                 {
@@ -197,6 +449,15 @@ namespace MZ
             }
         }
 
+        // TCodec: input is decoded, the sorted chunks are written to runs for Sort(runs, ...)
+        void ChunkSort(File& input, File& runs, const std::function<void(TRecord& record)>& preSortAction = nullptr)
+        {
+            static_assert(bEncoded, "ChunkSort(input, runs) requires TCodec");
+
+            ChunkSortEncoded(input, &runs, preSortAction, nullptr);
+        }
+
+        // TCodec: file is the runs file of ChunkSort(input, runs, ...)
         void Sort(File& file, const std::function<void(const TRecord& record)>& recordAction)
         {
             size_t numRecords = 0;
@@ -206,7 +467,19 @@ namespace MZ
                 ci.begin = ci.end = ci.offset = 0; numRecords += ci.raw_data_size;
             }
 
-            assert(file.Size() / sizeof(TRecord) == numRecords);
+            assert(bEncoded || file.Size() / sizeof(TRecord) == numRecords);
+
+            std::vector<EncodedRecordReader<TRecord, std::conditional_t<bEncoded, TCodec, int>>> readers;
+
+            if constexpr (bEncoded)
+            {
+                readers.resize(_numChunks);
+
+                for (size_t i = 0; i < _numChunks; i++)
+                {
+                    readers[i].Open(file, _chunkInfo[i].run_begin, _chunkInfo[i].run_end, EncodedBlockSize());
+                }
+            }
 
             auto queue_compare_records = [&](const size_t a, const size_t b)
             {
@@ -232,7 +505,19 @@ namespace MZ
                         ci.records.resize(ci.raw_data_size - ci.offset);
                     }
 
-                    ci.end = static_cast<size_t>(file.Read(static_cast<uint32_t>(i * _chunkSize + ci.offset), ci.records));
+                    if constexpr (bEncoded)
+                    {
+                        for (auto& record : ci.records)
+                        {
+                            mz_assert(readers[i].Next(record));
+                        }
+
+                        ci.end = static_cast<uint32_t>(ci.records.size());
+                    }
+                    else
+                    {
+                        ci.end = static_cast<size_t>(file.Read(static_cast<uint32_t>(i * _chunkSize + ci.offset), ci.records));
+                    }
 
                     assert(ci.end != 0);
 
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+#include "FileInfoStorage.h"
+
+template <typename CharT>
+class FileInfoDiff
+{
+public:
+
+	enum class Change { Added, Removed, Modified, Unchanged };
+
+	// prevId / currId == FileInfoStorage::NOT_FOUND for Added / Removed
+	using ActionType = std::function<void(Change change, uint32_t prevId, uint32_t currId)>;
+
+	struct Result
+	{
+		std::vector<uint32_t> added;	// curr ids
+		std::vector<uint32_t> removed;	// prev ids
+
+		std::vector<std::pair<uint32_t, uint32_t>> modified; // prev id, curr id
+
+		size_t unchanged = 0;
+	};
+
+	using StorageType = FileInfoStorage<CharT>;
+
+	static constexpr uint32_t NOT_FOUND = StorageType::NOT_FOUND;
+
+	// both catalogs are walked in path order, one linear merge pass
+	static void Compare(const StorageType& prev, const StorageType& curr, const ActionType& action, bool bReportUnchanged = false)
+	{
+		const auto a = prev.Sorted(StorageType::Order::Path);
+		const auto b = curr.Sorted(StorageType::Order::Path);
+
+		// интернированные директории, сравниваем строки только при смене пары директорий
+		struct
+		{
+			uint32_t prev = NOT_FOUND, curr = NOT_FOUND;
+
+			int result = 0;
+
+		} dirCache;
+
+		auto compare = [&](uint32_t pid, uint32_t cid)
+		{
+			const auto pd = prev.GetDirIndex(pid), cd = curr.GetDirIndex(cid);
+
+			if (pd != dirCache.prev || cd != dirCache.curr)
+			{
+				dirCache = { pd, cd, prev.GetPath(pid).compare(curr.GetPath(cid)) };
+			}
+
+			if (dirCache.result != 0) return dirCache.result;
+
+			return prev.GetName(pid).compare(curr.GetName(cid));
+		};
+
+		size_t i = 0, j = 0;
+
+		while (i < a.size() && j < b.size())
+		{
+			const auto result = compare(a[i], b[j]);
+
+			if (result < 0)
+			{
+				action(Change::Removed, a[i++], NOT_FOUND); continue;
+			}
+
+			if (result > 0)
+			{
+				action(Change::Added, NOT_FOUND, b[j++]); continue;
+			}
+
+			const auto pid = a[i++], cid = b[j++];
+
+			if (prev.GetSize(pid) != curr.GetSize(cid) || prev.GetTime(pid) != curr.GetTime(cid))
+			{
+				action(Change::Modified, pid, cid);
+			}
+			else if (bReportUnchanged)
+			{
+				action(Change::Unchanged, pid, cid);
+			}
+		}
+
+		for (; i < a.size(); i++) action(Change::Removed, a[i], NOT_FOUND);
+
+		for (; j < b.size(); j++) action(Change::Added, NOT_FOUND, b[j]);
+	}
+
+	static Result Compare(const StorageType& prev, const StorageType& curr)
+	{
+		Result result;
+
+		Compare(prev, curr, [&result](Change change, uint32_t prevId, uint32_t currId)
+			{
+				switch (change)
+				{
+				case Change::Added: result.added.push_back(currId); break;
+				case Change::Removed: result.removed.push_back(prevId); break;
+				case Change::Modified: result.modified.emplace_back(prevId, currId); break;
+				default: result.unchanged++; break;
+				}
+			}, true);
+
+		return result;
+	}
+};
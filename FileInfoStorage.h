@@ -1,41 +1,299 @@
 #pragma once
 
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <execution>
+
 #include "StringStorage.h"
 
 template <typename CharT>
 class FileInfoStorage
 {
-	StringStorage<CharT> ss;
+	// column of fixed-size chunks taken from the pool, index -> chunk like SimdHash::EntryArray
+	template <typename T, uint32_t Shift = 14>
+	class Column
+	{
+		static constexpr uint32_t ChunkSize = 1u << Shift, ChunkMask = ChunkSize - 1;
+
+		std::vector<T*> _chunks;
+
+		uint32_t _size = 0;
+
+	public:
+
+		__forceinline T& operator[](uint32_t index)
+		{
+			return _chunks[index >> Shift][index & ChunkMask];
+		}
+
+		__forceinline const T& operator[](uint32_t index) const
+		{
+			return _chunks[index >> Shift][index & ChunkMask];
+		}
+
+		uint32_t size() const
+		{
+			return _size;
+		}
+
+		void push_back(GrowingMemoryPool<uint8_t>& pool, const T& value)
+		{
+			if ((_size & ChunkMask) == 0 && (_size >> Shift) == _chunks.size())
+			{
+				_chunks.push_back(pool.template allocate<T>(ChunkSize));
+			}
+
+			(*this)[_size++] = value;
+		}
+
+		void clear()
+		{
+			_chunks.clear(); _size = 0;
+		}
+	};
+
+	StringStorage<CharT> dirs, names;
+
+	GrowingMemoryPool<uint8_t> pool;
 
-	struct FileInfoEntry
+	Column<uint32_t> dIndex, nIndex, fIndex;
+
+	Column<uint64_t> size;
+
+	Column<int64_t> mt;
+
+	// (dIndex << 32 | nIndex) -> id
+	MZ::SimdHash::Map<uint64_t, uint32_t> paths;
+
+	static __forceinline uint64_t PathKey(uint32_t d, uint32_t n)
+	{
+		return static_cast<uint64_t>(d) << 32 | n;
+	}
+
+public:
+
+	static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+	struct FileInfo
 	{
 		uint32_t dIndex;
+		uint32_t nIndex;
+		uint32_t fileIndex;
 
-		size_t size;
+		uint64_t size;
 
-		const CharT* name;
+		int64_t mt; // FileTimeToDecimal
 	};
 
-	GrowingMemoryPool<FileInfoEntry> pool;
+	enum class Order { Id, Size, Time, Path };
 
-public:
+	explicit FileInfoStorage(size_t page_size = 1024 * 1024) : dirs(page_size), names(page_size), pool(page_size) {}
+
+	// fileIndex == NOT_FOUND: the entry id is used as the file index
+	uint32_t Add(const CharT* path, const CharT* name, uint64_t fileSize, int64_t mtime = 0, uint32_t fileIndex = NOT_FOUND)
+	{
+		const auto d = dirs.GetOrAdd(path), n = names.GetOrAdd(name);
 
-	explicit FileInfoStorage(size_t page_size = 1024 * 1024) : ss(page_size), pool(page_size) {}
+		uint32_t id = Count();
 
-	void Add(const CharT* path, const CharT* name, size_t size)
+		if (!paths.TryGetValue(PathKey(d, n), id))
+		{
+			paths.Add(PathKey(d, n), id);
+
+			dIndex.push_back(pool, d); nIndex.push_back(pool, n);
+
+			fIndex.push_back(pool, (fileIndex == NOT_FOUND) ? id : fileIndex);
+
+			size.push_back(pool, fileSize); mt.push_back(pool, mtime);
+
+			return id;
+		}
+
+		// повторное добавление, обновляем запись
+		if (fileIndex != NOT_FOUND) fIndex[id] = fileIndex;
+
+		size[id] = fileSize; mt[id] = mtime; return id;
+	}
+
+	uint32_t Count() const
+	{
+		return dIndex.size();
+	}
+
+	uint32_t Find(const CharT* path, const CharT* name)
 	{
-		auto ptr = pool.allocate();
-	
-		ptr->dIndex = ss.GetOrAdd(path);
+		const auto d = dirs.Get(path);
+
+		if (d == NOT_FOUND) return NOT_FOUND;
+
+		const auto n = names.Get(name);
+
+		if (n == NOT_FOUND) return NOT_FOUND;
 
-		ptr->name = ss.MakeString(name);
+		uint32_t id = NOT_FOUND;
 
-		ptr->size = size;
+		paths.TryGetValue(PathKey(d, n), id); return id;
 	}
 
+	// full path, the directory part ends with '\\' or '/' as in FileEnumerator
+	uint32_t Find(const std::basic_string<CharT>& fullPath)
+	{
+		static constexpr CharT separators[] = { CharT('\\'), CharT('/'), CharT(0) };
+
+		const auto pos = fullPath.find_last_of(separators);
+
+		if (pos == std::basic_string<CharT>::npos) return NOT_FOUND;
+
+		const auto path = fullPath.substr(0, pos + 1);
+
+		return Find(path.c_str(), fullPath.c_str() + pos + 1);
+	}
+
+	FileInfo Get(uint32_t id) const
+	{
+		mz_assert(id < Count());
+
+		return { dIndex[id], nIndex[id], fIndex[id], size[id], mt[id] };
+	}
+
+	uint32_t GetDirIndex(uint32_t id) const { return dIndex[id]; }
+
+	uint32_t GetNameIndex(uint32_t id) const { return nIndex[id]; }
+
+	uint32_t GetFileIndex(uint32_t id) const { return fIndex[id]; }
+
+	uint64_t GetSize(uint32_t id) const { return size[id]; }
+
+	int64_t GetTime(uint32_t id) const { return mt[id]; }
+
+	std::basic_string_view<CharT> GetPath(uint32_t id) const
+	{
+		return dirs.GetString(dIndex[id]);
+	}
+
+	std::basic_string_view<CharT> GetName(uint32_t id) const
+	{
+		return names.GetString(nIndex[id]);
+	}
+
+	std::basic_string<CharT> GetFullPath(uint32_t id) const
+	{
+		std::basic_string<CharT> result(GetPath(id)); result.append(GetName(id)); return result;
+	}
+
+	const StringStorage<CharT>& Dirs() const
+	{
+		return dirs;
+	}
+
+	const StringStorage<CharT>& Names() const
+	{
+		return names;
+	}
+
+	// ids in the requested order, Size and Time are descending
+	std::vector<uint32_t> Sorted(Order order) const
+	{
+		std::vector<uint32_t> ids(Count()); std::iota(ids.begin(), ids.end(), 0);
+
+		if (order == Order::Size)
+		{
+			std::sort(std::execution::par, ids.begin(), ids.end(),
+				[this](const uint32_t a, const uint32_t b)
+				{
+					return size[a] > size[b] || (size[a] == size[b] && a < b);
+				});
+		}
+		else if (order == Order::Time)
+		{
+			std::sort(std::execution::par, ids.begin(), ids.end(),
+				[this](const uint32_t a, const uint32_t b)
+				{
+					return mt[a] > mt[b] || (mt[a] == mt[b] && a < b);
+				});
+		}
+		else if (order == Order::Path)
+		{
+			// строки сравниваются только при ранжировании уникальных директорий и имен
+			const auto dRank = Ranks(dirs), nRank = Ranks(names);
+
+			std::sort(std::execution::par, ids.begin(), ids.end(),
+				[&](const uint32_t a, const uint32_t b)
+				{
+					const auto ka = static_cast<uint64_t>(dRank[dIndex[a]]) << 32 | nRank[nIndex[a]];
+					const auto kb = static_cast<uint64_t>(dRank[dIndex[b]]) << 32 | nRank[nIndex[b]];
+
+					return ka < kb;
+				});
+		}
+
+		return ids;
+	}
+
+	template <typename TFunc>
+	void ForEach(Order order, const TFunc& action) const
+	{
+		if (order == Order::Id)
+		{
+			for (uint32_t id = 0; id < Count(); id++) action(id, Get(id));
+
+			return;
+		}
+
+		for (const auto id : Sorted(order)) action(id, Get(id));
+	}
+
+	void Export(std::vector<FileInfo>& output) const
+	{
+		output.resize(Count());
+
+		for (uint32_t id = 0; id < Count(); id++) output[id] = Get(id);
+	}
+
+	// (dir, name) lexicographic compare
+	int ComparePath(uint32_t a, uint32_t b) const
+	{
+		if (dIndex[a] != dIndex[b])
+		{
+			const auto result = GetPath(a).compare(GetPath(b));
+
+			if (result != 0) return result;
+		}
+
+		if (nIndex[a] == nIndex[b]) return 0;
+
+		return GetName(a).compare(GetName(b));
+	}
+
+private:
+
+	static std::vector<uint32_t> Ranks(const StringStorage<CharT>& ss)
+	{
+		std::vector<uint32_t> ids(ss.Count()), ranks(ss.Count()); std::iota(ids.begin(), ids.end(), 0);
+
+		std::sort(std::execution::par, ids.begin(), ids.end(),
+			[&ss](const uint32_t a, const uint32_t b)
+			{
+				return ss.GetString(a) < ss.GetString(b);
+			});
+
+		for (uint32_t i = 0; i < ids.size(); i++) ranks[ids[i]] = i;
+
+		return ranks;
+	}
+
+public:
+
 	void clear()
 	{
-		ss.Clear(); pool.release();
+		dirs.Clear(); names.Clear(); paths.Clear(paths.MIN_SIZE);
+
+		dIndex.clear(); nIndex.clear(); fIndex.clear(); size.clear(); mt.clear();
+
+		pool.release();
 	}
-};
 
+	FileInfoStorage(const FileInfoStorage&) = delete;
+	FileInfoStorage& operator=(const FileInfoStorage&) = delete;
+};
@@ -1,7 +1,14 @@
 #pragma once
 
+#if !defined(_WIN32)
+
+#include "FileSystemLinux.h"
+
+#else
+
 #include <windows.h>
 
+#include <span>
 #include <string>
 #include <stdexcept>
 #include <functional>
@@ -209,6 +216,14 @@ namespace MZ
     };
 
 
+    // one piece of File::WriteGather
+    struct WriteSegment
+    {
+        const uint8_t* data;
+
+        size_t size;
+    };
+
     class File
     {
         HANDLE fileHandle = INVALID_HANDLE_VALUE;
@@ -217,6 +232,11 @@ namespace MZ
 
         OVERLAPPED overlapped = { 0 };
 
+        bool bNoBuffering = false;
+
+        // WriteGather с невыровненными сегментами на FILE_FLAG_NO_BUFFERING, открывается один раз
+        HANDLE bufferedHandle = INVALID_HANDLE_VALUE;
+
     public:
 
         std::wstring GetLastErrorW()
@@ -262,7 +282,7 @@ namespace MZ
                 lastError = ::GetLastError(); return false;
             }
 
-            return true;
+            bNoBuffering = (flags & FILE_FLAG_NO_BUFFERING) != 0; return true;
         }
 
         bool Create(const wchar_t* path, const DWORD dwDesiredAccess, const DWORD dwShareMode, const DWORD flags)
@@ -277,7 +297,7 @@ namespace MZ
                 lastError = ::GetLastError(); return false;
             }
 
-            return true;
+            bNoBuffering = (flags & FILE_FLAG_NO_BUFFERING) != 0; return true;
         }
 
         DWORD ReadInternal(byte* buffer, DWORD nNumberOfBytesToRead)
@@ -344,6 +364,19 @@ namespace MZ
             return size.QuadPart;
         }
 
+        // обрезает файл по текущей позиции
+        bool Truncate()
+        {
+            mz_assert(IsOpen() == true);
+
+            if (!::SetEndOfFile(fileHandle))
+            {
+                lastError = ::GetLastError(); return false;
+            }
+
+            return true;
+        }
+
         ~File()
         {
             Close();
@@ -353,14 +386,27 @@ namespace MZ
         {
             if (IsOpen())
             {
-                if (lastError == ERROR_IO_PENDING)
+                if (lastError == ERROR_IO_PENDING || inFlight)
                 {
                     CancelIo(fileHandle);
                 }
 
+                for (; inFlight; inFlight--, requestHead = (requestHead + 1) % requests.size())
+                {
+                    Wait(requests[requestHead]);
+                }
+
                 ::CloseHandle(fileHandle);
             }
 
+            if (bufferedHandle != INVALID_HANDLE_VALUE) ::CloseHandle(bufferedHandle);
+
+            bufferedHandle = INVALID_HANDLE_VALUE; bNoBuffering = false;
+
+            for (auto& r : requests) ::CloseHandle(r.ov.hEvent);
+
+            requests.clear(); requestHead = 0;
+
             overlapped = { 0 }; fileHandle = INVALID_HANDLE_VALUE; lastError = ERROR_SUCCESS;
         }
 
@@ -399,10 +445,237 @@ namespace MZ
             return Create(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, flags);
         }
 
+    private:
+
+        struct AsyncRequest
+        {
+            OVERLAPPED ov;
+
+            uint64_t tag;
+
+            int32_t result;
+
+            bool bDone;
+        };
+
+        // OVERLAPPED не должны перемещаться, слоты выделяются один раз на первый запрос
+        std::vector<AsyncRequest> requests;
+
+        uint32_t requestHead = 0, inFlight = 0;
+
+        void Wait(AsyncRequest& r)
+        {
+            if (r.bDone) return;
+
+            DWORD NumberOfBytes = 0;
+
+            if (::GetOverlappedResult(fileHandle, &r.ov, &NumberOfBytes, TRUE))
+            {
+                r.result = static_cast<int32_t>(NumberOfBytes);
+            }
+            else
+            {
+                const auto error = ::GetLastError();
+
+                r.result = (error == ERROR_HANDLE_EOF) ? 0 : -static_cast<int32_t>(error);
+            }
+
+            r.bDone = true;
+        }
+
+        bool SubmitInternal(bool bWrite, const byte* buffer, uint32_t size, int64_t offset, uint64_t tag, bool bLink)
+        {
+            mz_assert(IsOpen() == true);
+
+            if (requests.size() == 0)
+            {
+                requests.resize(defaultQueueDepth);
+
+                for (auto& r : requests)
+                {
+                    r = { 0 }; r.ov.hEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+                }
+            }
+
+            if (inFlight == requests.size()) return false;
+
+            auto& r = requests[(requestHead + inFlight) % requests.size()];
+
+            const auto hEvent = r.ov.hEvent;
+
+            r.ov = { 0 }; r.ov.hEvent = hEvent;
+
+            r.ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF); r.ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+            r.tag = tag; r.result = 0; r.bDone = false;
+
+            const auto bResult = (bWrite)
+                ? ::WriteFile(fileHandle, buffer, size, nullptr, &r.ov)
+                : ::ReadFile(fileHandle, const_cast<byte*>(buffer), size, nullptr, &r.ov);
+
+            if (!bResult)
+            {
+                const auto error = ::GetLastError();
+
+                if (error != ERROR_IO_PENDING)
+                {
+                    r.result = (error == ERROR_HANDLE_EOF) ? 0 : -static_cast<int32_t>(error); r.bDone = true;
+                }
+            }
+
+            inFlight++;
+
+            if (bLink) Wait(r); // Windows не упорядочивает запросы, связанный дожидаемся сразу
+
+            return true;
+        }
+
+    public:
+
+        static constexpr uint32_t defaultQueueDepth = 64;
+
+        uint32_t QueueDepth() const
+        {
+            return defaultQueueDepth;
+        }
+
+        uint32_t InFlight() const
+        {
+            return inFlight;
+        }
+
+        // async, as in the Linux backend: the buffer must stay valid until its completion
+        bool SubmitRead(uint8_t* buffer, uint32_t size, int64_t offset, uint64_t tag, int bufferIndex = -1)
+        {
+            return SubmitInternal(false, buffer, size, offset, tag, false);
+        }
+
+        // bLink: the next submitted request starts after this one completes
+        bool SubmitWrite(const uint8_t* buffer, uint32_t size, int64_t offset, uint64_t tag, bool bLink = false, int bufferIndex = -1)
+        {
+            return SubmitInternal(true, buffer, size, offset, tag, bLink);
+        }
+
+        // completions are reported in submit order, result < 0 is -GetLastError()
+        uint32_t Complete(const std::function<void(uint64_t tag, int32_t result)>& action, uint32_t minComplete = 1)
+        {
+            uint32_t count = 0;
+
+            while (inFlight)
+            {
+                auto& r = requests[requestHead];
+
+                if (count >= minComplete && !r.bDone && !HasOverlappedIoCompleted(&r.ov)) break;
+
+                Wait(r);
+
+                requestHead = (requestHead + 1) % requests.size(); inFlight--; count++;
+
+                action(r.tag, r.result);
+            }
+
+            return count;
+        }
+
+    private:
+
+        // NoBuffering требует выравнивания адреса, размера и смещения каждого сегмента
+        static bool IsAligned(const WriteSegment* segments, size_t count, int64_t offset)
+        {
+            uint64_t bits = static_cast<uint64_t>(offset);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                bits |= reinterpret_cast<uintptr_t>(segments[i].data) | segments[i].size;
+            }
+
+            return (bits & 4095) == 0;
+        }
+
+        // как сброс O_DIRECT в Linux: невыровненные сегменты пишутся через кэш по второму handle того же файла,
+        // согласованность кэшированного и некэшированного доступа к одному файлу обеспечивает файловая система
+        bool WriteGatherBuffered(const WriteSegment* segments, size_t count, int64_t offset)
+        {
+            if (bufferedHandle == INVALID_HANDLE_VALUE)
+            {
+                bufferedHandle = ::ReOpenFile(fileHandle, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_FLAG_SEQUENTIAL_SCAN);
+
+                if (bufferedHandle == INVALID_HANDLE_VALUE)
+                {
+                    lastError = ::GetLastError(); return false;
+                }
+            }
+
+            for (size_t i = 0; i < count; i++)
+            {
+                for (size_t done = 0; done < segments[i].size; )
+                {
+                    const auto size = static_cast<DWORD>(std::min<size_t>(segments[i].size - done, 1u << 30));
+
+                    OVERLAPPED ov = { 0 }; DWORD NumberOfBytesWritten = 0;
+
+                    ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF); ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+                    if (!::WriteFile(bufferedHandle, segments[i].data + done, size, &NumberOfBytesWritten, &ov))
+                    {
+                        lastError = ::GetLastError(); SeekBegin(offset); return false;
+                    }
+
+                    offset += NumberOfBytesWritten; done += NumberOfBytesWritten;
+                }
+            }
+
+            SeekBegin(offset); return true;
+        }
+
+    public:
+
+        // сегменты пишутся параллельно по смежным смещениям от Position(), без сборки в один буфер
+        // WriteFileGather требует сегменты ровно в страницу памяти, поэтому через SubmitWrite
+        // NoBuffering и невыровненный сегмент (DataHeader, ключи): все сегменты идут через WriteGatherBuffered
+        bool WriteGather(const WriteSegment* segments, size_t count)
+        {
+            mz_assert(IsOpen() == true && inFlight == 0);
+
+            auto offset = Position();
+
+            if (bNoBuffering && !IsAligned(segments, count, offset)) return WriteGatherBuffered(segments, count, offset);
+
+            bool bResult = true;
+
+            auto action = [&](uint64_t, int32_t result)
+            {
+                if (result < 0)
+                {
+                    lastError = static_cast<DWORD>(-result); bResult = false;
+                }
+            };
+
+            for (size_t i = 0; i < count; i++)
+            {
+                for (size_t done = 0; done < segments[i].size; )
+                {
+                    const auto size = static_cast<uint32_t>(std::min<size_t>(segments[i].size - done, 1u << 30));
+
+                    while (!SubmitWrite(segments[i].data + done, size, offset, i)) Complete(action);
+
+                    offset += size; done += size;
+                }
+            }
+
+            Complete(action, inFlight);
+
+            SeekBegin(offset);
+
+            mz_assert(lastError != ERROR_INVALID_PARAMETER);
+
+            return bResult;
+        }
+
         static constexpr uint32_t defaultBlockSize = 128u * 1024;
 
-        template <typename T>
-        void Write(const std::vector<T>& data, uint32_t blockSize = defaultBlockSize)
+        template <typename T, typename A>
+        void Write(const std::vector<T, A>& data, uint32_t blockSize = defaultBlockSize)
         {
             Write((uint8_t*)data.data(), data.size() * sizeof(T), blockSize);
         }
@@ -420,8 +693,8 @@ namespace MZ
             }
         }
 
-        template <typename T>
-        DWORD Read(const std::vector<T>& data, uint32_t blockSize = defaultBlockSize)
+        template <typename T, typename A>
+        DWORD Read(const std::vector<T, A>& data, uint32_t blockSize = defaultBlockSize)
         {
             const auto length = Read((uint8_t*)data.data(), data.size() * sizeof(T), blockSize);
 
@@ -430,8 +703,8 @@ namespace MZ
             return length / sizeof(T);
         }
 
-        template <typename T>
-        DWORD Read(const uint32_t index, const std::vector<T>& data, uint32_t blockSize = defaultBlockSize)
+        template <typename T, typename A>
+        DWORD Read(const uint32_t index, const std::vector<T, A>& data, uint32_t blockSize = defaultBlockSize)
         {
             mz_assert(SeekBegin(index * sizeof(T)) == index * sizeof(T));
 
@@ -467,8 +740,8 @@ namespace MZ
             return Seek(dist, FILE_CURRENT);
         }
 
-        template <typename T>
-        int64_t SeekBack(const std::vector<T>& data)
+        template <typename T, typename A>
+        int64_t SeekBack(const std::vector<T, A>& data)
         {
             return SeekBack(data.size() * sizeof(T));
         }
@@ -592,4 +865,152 @@ namespace MZ
             return NumberOfBytesRead;
         }
     };
+
+    // read-only view of a whole file
+    class MappedFile
+    {
+        HANDLE fileHandle = INVALID_HANDLE_VALUE, mapHandle = nullptr;
+
+        const uint8_t* view = nullptr;
+
+        size_t viewSize = 0;
+
+        DWORD lastError = ERROR_SUCCESS;
+
+    public:
+
+        enum class Access { Normal, Sequential, Random };
+
+        std::wstring GetLastErrorW()
+        {
+            mz_assert(IsError());
+
+            return MZ::GetLastErrorW(lastError);
+        }
+
+        std::string GetLastErrorA()
+        {
+            mz_assert(IsError());
+
+            return MZ::GetLastErrorA(lastError);
+        }
+
+        bool IsOpen() const
+        {
+            return view != nullptr;
+        }
+
+        bool IsError() const
+        {
+            return lastError != ERROR_SUCCESS;
+        }
+
+        // FILE_SHARE_WRITE: the file may stay open in MZ::File, as lk.dat in LargeKeyStorage
+        bool Open(const wchar_t* path, Access access = Access::Normal)
+        {
+            mz_assert(IsOpen() != true);
+
+            DWORD flags = FILE_ATTRIBUTE_NORMAL;
+
+            if (access == Access::Sequential) flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+
+            if (access == Access::Random) flags |= FILE_FLAG_RANDOM_ACCESS;
+
+            fileHandle = ::CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, flags, nullptr);
+
+            if (fileHandle == INVALID_HANDLE_VALUE)
+            {
+                lastError = ::GetLastError(); return false;
+            }
+
+            LARGE_INTEGER size = { 0 };
+
+            if (!::GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0)
+            {
+                lastError = (size.QuadPart == 0) ? ERROR_HANDLE_EOF : ::GetLastError(); Close(); return false;
+            }
+
+            mapHandle = ::CreateFileMapping(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+            if (mapHandle != nullptr)
+            {
+                view = static_cast<const uint8_t*>(::MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0));
+            }
+
+            if (view == nullptr)
+            {
+                lastError = ::GetLastError(); Close(); return false;
+            }
+
+            viewSize = static_cast<size_t>(size.QuadPart); return true;
+        }
+
+        void Close()
+        {
+            if (view) ::UnmapViewOfFile(view);
+
+            if (mapHandle) ::CloseHandle(mapHandle);
+
+            if (fileHandle != INVALID_HANDLE_VALUE) ::CloseHandle(fileHandle);
+
+            view = nullptr; viewSize = 0; mapHandle = nullptr; fileHandle = INVALID_HANDLE_VALUE;
+        }
+
+        const uint8_t* data() const
+        {
+            return view;
+        }
+
+        size_t size() const
+        {
+            return viewSize;
+        }
+
+        template <typename T>
+        std::span<const T> span() const
+        {
+            return { reinterpret_cast<const T*>(view), viewSize / sizeof(T) };
+        }
+
+        // count is clamped to the end of the view
+        template <typename T>
+        std::span<const T> span(size_t index, size_t count) const
+        {
+            const auto all = span<T>();
+
+            if (index >= all.size()) return {};
+
+            return all.subspan(index, std::min(count, all.size() - index));
+        }
+
+        // на Windows подсказка задается флагами CreateFile в Open, view не меняется
+        void Advise(Access access)
+        {
+            mz_assert(IsOpen() == true);
+        }
+
+        // asynchronous page-in of [offset, offset + length)
+        void Prefetch(size_t offset, size_t length) const
+        {
+            mz_assert(IsOpen() == true);
+
+            if (offset >= viewSize) return;
+
+            WIN32_MEMORY_RANGE_ENTRY range = { const_cast<uint8_t*>(view) + offset, std::min(length, viewSize - offset) };
+
+            ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+        }
+
+        MappedFile() = default;
+
+        ~MappedFile()
+        {
+            Close();
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+    };
 }
+
+#endif
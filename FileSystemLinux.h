@@ -0,0 +1,961 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "Assert.h"
+
+// Linux counterpart of FileSystem.h: File on io_uring, MappedFile on mmap
+
+namespace MZ
+{
+    using byte = uint8_t;
+
+    using DWORD = uint32_t;
+
+    static std::string WStringToAString(const std::wstring& wstr)
+    {
+        std::string str; str.reserve(wstr.size());
+
+        for (const auto wch : wstr)
+        {
+            const auto cp = static_cast<uint32_t>(wch);
+
+            if (cp < 0x80)
+            {
+                str.push_back(static_cast<char>(cp));
+            }
+            else if (cp < 0x800)
+            {
+                str.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+                str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            }
+            else if (cp < 0x10000)
+            {
+                str.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+                str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+                str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            }
+            else
+            {
+                str.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+                str.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+                str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+                str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            }
+        }
+
+        return str;
+    }
+
+    static std::string GetLastErrorA(int error)
+    {
+        return std::to_string(error) + ", " + std::strerror(error);
+    }
+
+    static std::wstring GetLastErrorW(int error)
+    {
+        const auto str = GetLastErrorA(error);
+
+        return std::wstring(str.begin(), str.end());
+    }
+
+    // minimal io_uring on raw syscalls, single issuer
+    class IoUring
+    {
+        int ringFd = -1;
+
+        uint32_t* sqHead = nullptr, * sqTail = nullptr, * sqArray = nullptr, sqMask = 0;
+
+        uint32_t* cqHead = nullptr, * cqTail = nullptr, cqMask = 0;
+
+        io_uring_sqe* sqes = nullptr;
+
+        io_uring_cqe* cqes = nullptr;
+
+        void* sqPtr = nullptr, * cqPtr = nullptr;
+
+        size_t sqSize = 0, cqSize = 0, sqesSize = 0;
+
+        uint32_t entries = 0, cqEntries = 0, pending = 0;
+
+    public:
+
+        bool Init(uint32_t depth)
+        {
+            mz_assert(ringFd < 0);
+
+            io_uring_params p; std::memset(&p, 0, sizeof(p));
+
+            ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, depth, &p));
+
+            if (ringFd < 0) return false;
+
+            sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+            cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+            if (p.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                sqSize = cqSize = std::max(sqSize, cqSize);
+            }
+
+            sqPtr = ::mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+
+            if (sqPtr == MAP_FAILED)
+            {
+                sqPtr = nullptr; Close(); return false;
+            }
+
+            if (p.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                cqPtr = sqPtr;
+            }
+            else
+            {
+                cqPtr = ::mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+
+                if (cqPtr == MAP_FAILED)
+                {
+                    cqPtr = nullptr; Close(); return false;
+                }
+            }
+
+            sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+
+            sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+
+            if (sqes == MAP_FAILED)
+            {
+                sqes = nullptr; Close(); return false;
+            }
+
+            auto sq = static_cast<uint8_t*>(sqPtr), cq = static_cast<uint8_t*>(cqPtr);
+
+            sqHead = reinterpret_cast<uint32_t*>(sq + p.sq_off.head);
+            sqTail = reinterpret_cast<uint32_t*>(sq + p.sq_off.tail);
+            sqMask = *reinterpret_cast<uint32_t*>(sq + p.sq_off.ring_mask);
+            sqArray = reinterpret_cast<uint32_t*>(sq + p.sq_off.array);
+
+            cqHead = reinterpret_cast<uint32_t*>(cq + p.cq_off.head);
+            cqTail = reinterpret_cast<uint32_t*>(cq + p.cq_off.tail);
+            cqMask = *reinterpret_cast<uint32_t*>(cq + p.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+            entries = p.sq_entries; cqEntries = p.cq_entries; return true;
+        }
+
+        bool IsOpen() const
+        {
+            return ringFd >= 0;
+        }
+
+        uint32_t Entries() const
+        {
+            return entries;
+        }
+
+        // больше запросов в полете CQ не вместит
+        uint32_t CqEntries() const
+        {
+            return cqEntries;
+        }
+
+        void Close()
+        {
+            if (sqes) ::munmap(sqes, sqesSize);
+
+            if (cqPtr && cqPtr != sqPtr) ::munmap(cqPtr, cqSize);
+
+            if (sqPtr) ::munmap(sqPtr, sqSize);
+
+            if (ringFd >= 0) ::close(ringFd);
+
+            sqes = nullptr; sqPtr = cqPtr = nullptr; ringFd = -1; entries = cqEntries = pending = 0;
+        }
+
+        ~IoUring()
+        {
+            Close();
+        }
+
+        // nullptr when the submission queue is full
+        io_uring_sqe* GetSqe()
+        {
+            const auto head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE), tail = *sqTail + pending;
+
+            if (tail - head >= entries) return nullptr;
+
+            const auto index = tail & sqMask;
+
+            auto sqe = &sqes[index]; std::memset(sqe, 0, sizeof(*sqe));
+
+            sqArray[index] = index; pending++;
+
+            return sqe;
+        }
+
+        // submits prepared sqes and waits for at least waitNr completions
+        int Submit(uint32_t waitNr = 0)
+        {
+            if (pending)
+            {
+                __atomic_store_n(sqTail, *sqTail + pending, __ATOMIC_RELEASE);
+            }
+
+            const auto toSubmit = pending; pending = 0;
+
+            if (toSubmit == 0 && waitNr == 0) return 0;
+
+            int result;
+
+            do
+            {
+                result = static_cast<int>(::syscall(__NR_io_uring_enter, ringFd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+
+            } while (result < 0 && errno == EINTR);
+
+            return result;
+        }
+
+        bool PeekCqe(io_uring_cqe& cqe)
+        {
+            const auto head = *cqHead;
+
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+
+            cqe = cqes[head & cqMask];
+
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE); return true;
+        }
+
+        int Register(uint32_t opcode, const void* arg, uint32_t nr_args)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_register, ringFd, opcode, arg, nr_args));
+        }
+
+        IoUring() = default;
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+    };
+
+    // one piece of File::WriteGather
+    struct WriteSegment
+    {
+        const uint8_t* data;
+
+        size_t size;
+    };
+
+    class File
+    {
+        int fileHandle = -1;
+
+        int lastError = 0;
+
+        int64_t position = 0, overlappedPosition = 0;
+
+        IoUring ring;
+
+        uint32_t inFlight = 0;
+
+        bool bRegisteredBuffers = false, bDirect = false;
+
+        struct Completion
+        {
+            uint64_t tag;
+            int32_t result;
+        };
+
+        std::vector<Completion> completions; // sync fallback when io_uring is not available
+
+    public:
+
+        static constexpr uint32_t defaultQueueDepth = 64;
+
+        std::wstring GetLastErrorW()
+        {
+            mz_assert(IsError());
+
+            return MZ::GetLastErrorW(lastError);
+        }
+
+        std::string GetLastErrorA()
+        {
+            mz_assert(IsError());
+
+            return MZ::GetLastErrorA(lastError);
+        }
+
+        bool IsOpen() const
+        {
+            return fileHandle >= 0;
+        }
+
+        bool IsError() const
+        {
+            return lastError != 0;
+        }
+
+        bool IsSharingViolation() const
+        {
+            return lastError == ETXTBSY;
+        }
+
+    private:
+
+        bool OpenInternal(const wchar_t* path, int flags, bool DeleteOnClose, uint32_t queueDepth = defaultQueueDepth)
+        {
+            mz_assert(IsOpen() != true);
+
+            const auto pathA = WStringToAString(path);
+
+            fileHandle = ::open(pathA.c_str(), flags | O_CLOEXEC, 0644);
+
+            if (!IsOpen())
+            {
+                lastError = errno; return false;
+            }
+
+            if (DeleteOnClose) ::unlink(pathA.c_str());
+
+            bDirect = (flags & O_DIRECT) != 0;
+
+            ring.Init(queueDepth); // без io_uring работаем через pread/pwrite
+
+            position = overlappedPosition = 0; return true;
+        }
+
+        static int Flags(bool NoBuffering)
+        {
+            return (NoBuffering) ? O_DIRECT : 0;
+        }
+
+        void Prepare(io_uring_sqe* sqe, uint8_t opcode, const void* buffer, uint32_t size, int64_t offset, uint64_t tag, int bufferIndex)
+        {
+            sqe->opcode = opcode; sqe->fd = fileHandle;
+
+            sqe->addr = reinterpret_cast<uint64_t>(buffer); sqe->len = size; sqe->off = static_cast<uint64_t>(offset);
+
+            sqe->user_data = tag;
+
+            if (bufferIndex >= 0) sqe->buf_index = static_cast<uint16_t>(bufferIndex);
+        }
+
+        // O_DIRECT требует выравнивания адреса, размера и смещения, иначе EINVAL, для такого запроса уходим в page cache
+        void CheckDirect(const uint8_t* buffer, uint32_t size, int64_t offset)
+        {
+            if (bDirect && ((reinterpret_cast<uintptr_t>(buffer) | size | static_cast<uint64_t>(offset)) & 4095))
+            {
+                ::fcntl(fileHandle, F_SETFL, ::fcntl(fileHandle, F_GETFL) & ~O_DIRECT); bDirect = false;
+            }
+        }
+
+        bool SubmitInternal(bool bWrite, const uint8_t* buffer, uint32_t size, int64_t offset, uint64_t tag, bool bLink, int bufferIndex)
+        {
+            mz_assert(IsOpen() == true);
+
+            CheckDirect(buffer, size, offset);
+
+            if (!ring.IsOpen())
+            {
+                const auto result = bWrite
+                    ? ::pwrite(fileHandle, buffer, size, offset)
+                    : ::pread(fileHandle, const_cast<uint8_t*>(buffer), size, offset);
+
+                completions.push_back({ tag, static_cast<int32_t>((result < 0) ? -errno : result) });
+
+                inFlight++; return true;
+            }
+
+            if (inFlight >= ring.CqEntries()) return false; // сначала Complete, иначе переполнение CQ
+
+            auto sqe = ring.GetSqe();
+
+            if (sqe == nullptr)
+            {
+                ring.Submit(); sqe = ring.GetSqe();
+
+                if (sqe == nullptr) return false;
+            }
+
+            const bool bFixed = bufferIndex >= 0 && bRegisteredBuffers;
+
+            if (bWrite)
+                Prepare(sqe, bFixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, buffer, size, offset, tag, bFixed ? bufferIndex : -1);
+            else
+                Prepare(sqe, bFixed ? IORING_OP_READ_FIXED : IORING_OP_READ, buffer, size, offset, tag, bFixed ? bufferIndex : -1);
+
+            if (bLink) sqe->flags |= IOSQE_IO_LINK;
+
+            inFlight++; return true;
+        }
+
+        // Write/Read: блоки по blockSize от position, tag - смещение начала запроса в buffer
+        // короткий результат дочитывается/дописывается с того же места, иначе в файле дырка
+        // чтение, вернувшее 0 (конец файла), не повторяется
+        int64_t Transfer(bool bWrite, byte* buffer, size_t size, uint32_t blockSize)
+        {
+            mz_assert(inFlight == 0);
+
+            int64_t transferred = 0;
+
+            std::vector<size_t> rest; // начала недоделанных остатков блоков
+
+            const auto blockEnd = [&](size_t offset)
+                {
+                    return std::min<size_t>((offset / blockSize + 1) * blockSize, size);
+                };
+
+            auto action = [&](uint64_t tag, int32_t result)
+                {
+                    if (result < 0)
+                    {
+                        lastError = -result; return;
+                    }
+
+                    if (result == 0)
+                    {
+                        if (bWrite)
+                        {
+                            lastError = ENOSPC;
+                        }
+
+                        return;
+                    }
+
+                    transferred += result;
+
+                    if (tag + result < blockEnd(tag)) rest.push_back(tag + result);
+                };
+
+            const auto submit = [&](size_t offset)
+                {
+                    const auto length = static_cast<uint32_t>(blockEnd(offset) - offset);
+
+                    while (!SubmitInternal(bWrite, buffer + offset, length, position + offset, offset, false, -1)) Complete(action);
+                };
+
+            for (size_t offset = 0; offset < size; offset += blockSize) submit(offset);
+
+            while (inFlight || !rest.empty())
+            {
+                if (rest.empty())
+                {
+                    Complete(action, inFlight); continue;
+                }
+
+                const auto offset = rest.back(); rest.pop_back();
+
+                if (!IsError()) submit(offset);
+            }
+
+            mz_assert(lastError != EINVAL);
+
+            return transferred;
+        }
+
+    public:
+
+        size_t Size()
+        {
+            mz_assert(IsOpen() == true);
+
+            struct stat st;
+
+            if (::fstat(fileHandle, &st) != 0)
+            {
+                lastError = errno;
+
+                mz_assert(false, "%s\n", GetLastErrorA().c_str());
+            }
+
+            return static_cast<size_t>(st.st_size);
+        }
+
+        // обрезает файл по текущей позиции
+        bool Truncate()
+        {
+            mz_assert(IsOpen() == true);
+
+            if (::ftruncate(fileHandle, position) != 0)
+            {
+                lastError = errno; return false;
+            }
+
+            return true;
+        }
+
+        ~File()
+        {
+            Close();
+        }
+
+        void Close()
+        {
+            if (IsOpen())
+            {
+                while (inFlight) Complete([](uint64_t, int32_t) {}, inFlight);
+
+                ring.Close(); ::close(fileHandle);
+            }
+
+            completions.clear(); bRegisteredBuffers = bDirect = false;
+
+            position = overlappedPosition = 0; fileHandle = -1; lastError = 0; inFlight = 0;
+        }
+
+        bool OpenReadOverlapped(const wchar_t* path, [[maybe_unused]] bool FileShareWrite = false, bool NoBuffering = true, uint32_t queueDepth = defaultQueueDepth)
+        {
+            return OpenInternal(path, O_RDONLY | Flags(NoBuffering), false, queueDepth);
+        }
+
+        bool OpenRead(const wchar_t* path, [[maybe_unused]] bool FileShareWrite = false, bool NoBuffering = true)
+        {
+            return OpenInternal(path, O_RDONLY | Flags(NoBuffering), false);
+        }
+
+        bool Open(const wchar_t* path, bool bWrite = true, bool NoBuffering = true, bool DeleteOnClose = false)
+        {
+            return OpenInternal(path, (bWrite ? O_RDWR : O_RDONLY) | Flags(NoBuffering), DeleteOnClose);
+        }
+
+        bool Create(const wchar_t* path, bool NoBuffering = true, bool DeleteOnClose = false)
+        {
+            return OpenInternal(path, O_RDWR | O_CREAT | O_TRUNC | Flags(NoBuffering), DeleteOnClose);
+        }
+
+        // registered buffers are used by SubmitRead/SubmitWrite with bufferIndex >= 0
+        bool RegisterBuffers(const std::vector<iovec>& buffers)
+        {
+            mz_assert(IsOpen() == true && inFlight == 0);
+
+            if (!ring.IsOpen()) return false;
+
+            bRegisteredBuffers = ring.Register(IORING_REGISTER_BUFFERS, buffers.data(), static_cast<uint32_t>(buffers.size())) == 0;
+
+            return bRegisteredBuffers;
+        }
+
+        uint32_t QueueDepth() const
+        {
+            return ring.IsOpen() ? ring.Entries() : 1;
+        }
+
+        uint32_t InFlight() const
+        {
+            return inFlight;
+        }
+
+        // async: the buffer must stay valid until its completion, with O_DIRECT 4096 aligned
+        // false: the queue is full, call Complete and submit again
+        bool SubmitRead(uint8_t* buffer, uint32_t size, int64_t offset, uint64_t tag, int bufferIndex = -1)
+        {
+            return SubmitInternal(false, buffer, size, offset, tag, false, bufferIndex);
+        }
+
+        // bLink: the next submitted request starts after this one completes
+        bool SubmitWrite(const uint8_t* buffer, uint32_t size, int64_t offset, uint64_t tag, bool bLink = false, int bufferIndex = -1)
+        {
+            return SubmitInternal(true, buffer, size, offset, tag, bLink, bufferIndex);
+        }
+
+        // submits queued requests, waits for at least minComplete, result < 0 is -errno
+        uint32_t Complete(const std::function<void(uint64_t tag, int32_t result)>& action, uint32_t minComplete = 1)
+        {
+            mz_assert(IsOpen() == true);
+
+            minComplete = std::min(minComplete, inFlight);
+
+            uint32_t count = 0;
+
+            if (!ring.IsOpen())
+            {
+                for (const auto& c : completions)
+                {
+                    inFlight--; count++; action(c.tag, c.result);
+                }
+
+                completions.clear(); return count;
+            }
+
+            ring.Submit();
+
+            io_uring_cqe cqe;
+
+            while (true)
+            {
+                while (ring.PeekCqe(cqe))
+                {
+                    inFlight--; count++; action(cqe.user_data, cqe.res);
+                }
+
+                if (count >= minComplete) break;
+
+                if (ring.Submit(minComplete - count) < 0 && errno != EBUSY)
+                {
+                    lastError = errno; mz_assert(false, "%s\n", GetLastErrorA().c_str());
+                }
+            }
+
+            return count;
+        }
+
+        // one pwritev at Position(), no assembly copy
+        bool WriteGather(const WriteSegment* segments, size_t count)
+        {
+            mz_assert(IsOpen() == true && inFlight == 0);
+
+            std::vector<iovec> iov(count);
+
+            int64_t offset = position;
+
+            for (size_t i = 0; i < count; i++)
+            {
+                iov[i] = { const_cast<uint8_t*>(segments[i].data), segments[i].size };
+
+                CheckDirect(segments[i].data, static_cast<uint32_t>(segments[i].size), offset); offset += segments[i].size;
+            }
+
+            auto first = iov.data(); auto n = static_cast<int>(count);
+
+            int64_t written = 0;
+
+            while (n > 0)
+            {
+                const auto result = ::pwritev(fileHandle, first, std::min(n, IOV_MAX), position + written);
+
+                if (result < 0)
+                {
+                    if (errno == EINTR) continue;
+
+                    lastError = errno; mz_assert(lastError != EINVAL); return false;
+                }
+
+                written += result;
+
+                // частичная запись, пропускаем записанные сегменты
+                for (auto rest = static_cast<size_t>(result); n > 0 && rest != 0; )
+                {
+                    if (rest < first->iov_len)
+                    {
+                        first->iov_base = static_cast<uint8_t*>(first->iov_base) + rest; first->iov_len -= rest; break;
+                    }
+
+                    rest -= first->iov_len; first++; n--;
+                }
+
+                while (n > 0 && first->iov_len == 0)
+                {
+                    first++; n--;
+                }
+            }
+
+            position += written; return true;
+        }
+
+        static constexpr uint32_t defaultBlockSize = 128u * 1024;
+
+        template <typename T, typename A>
+        void Write(const std::vector<T, A>& data, uint32_t blockSize = defaultBlockSize)
+        {
+            Write((uint8_t*)data.data(), data.size() * sizeof(T), blockSize);
+        }
+
+        // blocks are written in parallel up to the queue depth
+        void Write(const byte* buffer, size_t nNumberOfBytesToWrite, uint32_t blockSize = defaultBlockSize)
+        {
+            position += Transfer(true, const_cast<byte*>(buffer), nNumberOfBytesToWrite, blockSize);
+        }
+
+        template <typename T, typename A>
+        DWORD Read(const std::vector<T, A>& data, uint32_t blockSize = defaultBlockSize)
+        {
+            const auto length = Read((uint8_t*)data.data(), data.size() * sizeof(T), blockSize);
+
+            mz_assert((length % sizeof(T)) == 0);
+
+            return length / sizeof(T);
+        }
+
+        template <typename T, typename A>
+        DWORD Read(const uint32_t index, const std::vector<T, A>& data, uint32_t blockSize = defaultBlockSize)
+        {
+            mz_assert(SeekBegin(index * sizeof(T)) == index * sizeof(T));
+
+            return Read(data, blockSize);
+        }
+
+        // blocks are read in parallel up to the queue depth
+        DWORD Read(byte* buffer, size_t nNumberOfBytesToRead, uint32_t blockSize = defaultBlockSize)
+        {
+            const auto read = Transfer(false, buffer, nNumberOfBytesToRead, blockSize);
+
+            position += read; return static_cast<DWORD>(read);
+        }
+
+        int64_t SeekBegin(int64_t dist)
+        {
+            mz_assert(dist >= 0);
+
+            return position = dist;
+        }
+
+        int64_t SeekCurrent(int64_t dist)
+        {
+            return position += dist;
+        }
+
+        template <typename T, typename A>
+        int64_t SeekBack(const std::vector<T, A>& data)
+        {
+            return SeekBack(data.size() * sizeof(T));
+        }
+
+        int64_t SeekBack(int64_t dist)
+        {
+            mz_assert(dist >= 0);
+
+            return SeekCurrent(-dist);
+        }
+
+        int64_t SeekEnd(int64_t dist)
+        {
+            return position = static_cast<int64_t>(Size()) + dist;
+        }
+
+        void OverlappedPosition(int64_t offset)
+        {
+            mz_assert(offset >= 0 && (offset % 4096) == 0);
+
+            if (lastError == ENODATA) lastError = 0;
+
+            mz_assert(lastError == 0 && inFlight == 0);
+
+            overlappedPosition = offset;
+        }
+
+        int64_t OverlappedPosition() const
+        {
+            return overlappedPosition;
+        }
+
+        int64_t Position()
+        {
+            return position;
+        }
+
+    private:
+
+        std::vector<uint8_t> internal_buffer;
+
+    public:
+
+        // one read ahead, same contract as the Windows ReadOverlapped
+        DWORD ReadOverlapped(std::vector<uint8_t>& buffer)
+        {
+            mz_assert(IsOpen() == true);
+
+            if (lastError == ENODATA) return 0; // EOF
+
+            int32_t NumberOfBytesRead = 0;
+
+            auto action = [&](uint64_t, int32_t result)
+            {
+                if (result < 0)
+                {
+                    lastError = -result; mz_assert(false, "%s\n", GetLastErrorA().c_str());
+                }
+
+                NumberOfBytesRead = result;
+            };
+
+            if (inFlight == 0)
+            {
+                internal_buffer.resize(buffer.size());
+
+                SubmitRead(internal_buffer.data(), static_cast<uint32_t>(internal_buffer.size()), overlappedPosition, 0);
+            }
+
+            Complete(action, 1);
+
+            internal_buffer.swap(buffer);
+
+            if (NumberOfBytesRead == 0)
+            {
+                lastError = ENODATA; return 0;
+            }
+
+            overlappedPosition += NumberOfBytesRead;
+
+            if (buffer.size() == static_cast<size_t>(NumberOfBytesRead))
+            {
+                internal_buffer.resize(buffer.size());
+
+                SubmitRead(internal_buffer.data(), static_cast<uint32_t>(internal_buffer.size()), overlappedPosition, 0);
+
+                ring.Submit();
+            }
+            else
+            {
+                lastError = ENODATA;
+            }
+
+            return static_cast<DWORD>(NumberOfBytesRead);
+        }
+    };
+
+    // read-only view of a whole file
+    class MappedFile
+    {
+        int fileHandle = -1;
+
+        const uint8_t* view = nullptr;
+
+        size_t viewSize = 0;
+
+        int lastError = 0;
+
+    public:
+
+        enum class Access { Normal, Sequential, Random };
+
+        std::wstring GetLastErrorW()
+        {
+            mz_assert(IsError());
+
+            return MZ::GetLastErrorW(lastError);
+        }
+
+        std::string GetLastErrorA()
+        {
+            mz_assert(IsError());
+
+            return MZ::GetLastErrorA(lastError);
+        }
+
+        bool IsOpen() const
+        {
+            return view != nullptr;
+        }
+
+        bool IsError() const
+        {
+            return lastError != 0;
+        }
+
+        bool Open(const wchar_t* path, Access access = Access::Normal)
+        {
+            mz_assert(IsOpen() != true);
+
+            fileHandle = ::open(WStringToAString(path).c_str(), O_RDONLY | O_CLOEXEC);
+
+            if (fileHandle < 0)
+            {
+                lastError = errno; return false;
+            }
+
+            struct stat st;
+
+            if (::fstat(fileHandle, &st) != 0 || st.st_size == 0)
+            {
+                lastError = (st.st_size == 0) ? ENODATA : errno; Close(); return false;
+            }
+
+            auto ptr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fileHandle, 0);
+
+            if (ptr == MAP_FAILED)
+            {
+                lastError = errno; Close(); return false;
+            }
+
+            view = static_cast<const uint8_t*>(ptr); viewSize = static_cast<size_t>(st.st_size);
+
+            if (access != Access::Normal) Advise(access);
+
+            return true;
+        }
+
+        void Close()
+        {
+            if (view) ::munmap(const_cast<uint8_t*>(view), viewSize);
+
+            if (fileHandle >= 0) ::close(fileHandle);
+
+            view = nullptr; viewSize = 0; fileHandle = -1;
+        }
+
+        const uint8_t* data() const
+        {
+            return view;
+        }
+
+        size_t size() const
+        {
+            return viewSize;
+        }
+
+        template <typename T>
+        std::span<const T> span() const
+        {
+            return { reinterpret_cast<const T*>(view), viewSize / sizeof(T) };
+        }
+
+        // count is clamped to the end of the view
+        template <typename T>
+        std::span<const T> span(size_t index, size_t count) const
+        {
+            const auto all = span<T>();
+
+            if (index >= all.size()) return {};
+
+            return all.subspan(index, std::min(count, all.size() - index));
+        }
+
+        void Advise(Access access)
+        {
+            mz_assert(IsOpen() == true);
+
+            const int advice = (access == Access::Sequential) ? MADV_SEQUENTIAL : (access == Access::Random) ? MADV_RANDOM : MADV_NORMAL;
+
+            ::madvise(const_cast<uint8_t*>(view), viewSize, advice);
+        }
+
+        // asynchronous page-in of [offset, offset + length)
+        void Prefetch(size_t offset, size_t length) const
+        {
+            mz_assert(IsOpen() == true);
+
+            if (offset >= viewSize) return;
+
+            const auto begin = offset & ~size_t(4095);
+
+            ::madvise(const_cast<uint8_t*>(view) + begin, std::min(length, viewSize - offset) + (offset - begin), MADV_WILLNEED);
+        }
+
+        MappedFile() = default;
+
+        ~MappedFile()
+        {
+            Close();
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+    };
+}
@@ -166,4 +166,68 @@ namespace MZ
 
 #pragma pack(pop)
 
+    // header, keys and payload as separate segments for File::WriteGather, the block is never assembled
+    template <uint8_t key_size>
+    class DataBlock
+    {
+        DataHeader<key_size> dataHeader;
+
+        const uint8_t* keys = nullptr;
+        const uint8_t* data = nullptr;
+
+        uint32_t keys_size = 0, data_size = 0;
+
+    public:
+
+        DataHeader<key_size>& Header()
+        {
+            return dataHeader;
+        }
+
+        void Init(DecimalDateValue date, uint32_t index, uint32_t raw_size, uint16_t data_flags)
+        {
+            dataHeader.Init(date, index, raw_size, data_flags);
+
+            keys = data = nullptr; keys_size = data_size = 0;
+        }
+
+        // keys and payload are referenced, not copied, they must stay valid until the block is written
+        void SetKeys(const uint8_t* keys_data, uint32_t size)
+        {
+            assert((size % key_size) == 0 && size != 0 && keys_size == 0);
+
+            keys = keys_data; keys_size = size;
+
+            dataHeader.counter = size / key_size; dataHeader.header.SetSize(dataHeader.header.GetSize() + size);
+        }
+
+        void SetData(const uint8_t* payload, uint32_t size)
+        {
+            assert(dataHeader.counter != 0 && size != 0 && data_size == 0);
+
+            data = payload; data_size = size;
+
+            dataHeader.header.SetSize(dataHeader.header.GetSize() + size);
+        }
+
+        uint32_t Size() const
+        {
+            return dataHeader.header.GetSize();
+        }
+
+        // TSegment is {const uint8_t* data, size_t size}, MZ::WriteSegment
+        template <typename TSegment>
+        uint32_t GetSegments(TSegment (&segments)[3]) const
+        {
+            uint32_t count = 0;
+
+            segments[count++] = { reinterpret_cast<const uint8_t*>(&dataHeader), sizeof(dataHeader) };
+
+            if (keys_size) segments[count++] = { keys, keys_size };
+
+            if (data_size) segments[count++] = { data, data_size };
+
+            return count;
+        }
+    };
 }
@@ -2,11 +2,93 @@
 
 #include <cstddef>
 #include <vector>
+#include <new>
 #include <memory>
 #include <stack>
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 #include <Assert.h>
 
+enum class PageSourceType { Heap, Virtual, LargePages };
+
+class PageSource
+{
+public:
+
+    // heap pages are aligned like Virtual pages, so alignment inside a page is absolute
+    static constexpr size_t HeapAlignment = 4096;
+
+    static size_t LargePageSize()
+    {
+#if defined(_WIN32)
+        static const size_t size = ::GetLargePageMinimum();
+#else
+        static const size_t size = 2 * 1024 * 1024;
+#endif
+        return size;
+    }
+
+    // type may be downgraded: LargePages -> Virtual when huge pages are not available
+    static void* Allocate(size_t size, PageSourceType& type)
+    {
+        if (type == PageSourceType::LargePages)
+        {
+            const auto lps = LargePageSize();
+
+            if (lps != 0 && (size % lps) == 0)
+            {
+#if defined(_WIN32)
+                auto ptr = ::VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#else
+                auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+                if (ptr == MAP_FAILED) ptr = nullptr;
+#endif
+                if (ptr != nullptr) return ptr;
+            }
+
+            type = PageSourceType::Virtual;
+        }
+
+        if (type == PageSourceType::Virtual)
+        {
+#if defined(_WIN32)
+            auto ptr = ::VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+            auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (ptr == MAP_FAILED) ptr = nullptr;
+#if defined(MADV_HUGEPAGE)
+            else if (size >= LargePageSize()) ::madvise(ptr, size, MADV_HUGEPAGE); // THP
+#endif
+#endif
+            mz_assert(ptr != nullptr, "page size: %zu\n", size);
+
+            return ptr;
+        }
+
+        return ::operator new(size, std::align_val_t(HeapAlignment));
+    }
+
+    static void Free(void* ptr, size_t size, PageSourceType type)
+    {
+        if (type == PageSourceType::Heap)
+        {
+            ::operator delete(ptr, std::align_val_t(HeapAlignment)); return;
+        }
+#if defined(_WIN32)
+        ::VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        ::munmap(ptr, size);
+#endif
+    }
+};
+
 template<typename Type>
 class GrowingMemoryPool
 {
@@ -17,14 +99,16 @@ class GrowingMemoryPool
         size_t _size;
         size_t _used;
 
-        MemoryPage(size_t size) : _size(size), _used(0)
+        PageSourceType _type;
+
+        MemoryPage(size_t size, PageSourceType type) : _size(size), _used(0), _type(type)
         {
-            _ptr = ::operator new(size);
+            _ptr = PageSource::Allocate(size, _type);
         }
 
         ~MemoryPage()
         {
-            ::operator delete(_ptr);
+            PageSource::Free(_ptr, _size, _type);
         }
         
         MemoryPage(const MemoryPage&) = delete;
@@ -45,18 +129,27 @@ class GrowingMemoryPool
 
     PagesType _pages;
 
+    PagesType _free; // recycled pages, reused by allocatePage
+
     CheckpointsType _checkpoints;
 
-    size_t _page_size;
+    size_t _page_size, _reserved = 0;
+
+    PageSourceType _source;
 
     static constexpr size_t MIN_PAGE_SIZE = 4096;
 
+    static_assert(PageSource::HeapAlignment >= MIN_PAGE_SIZE, "page start must be MIN_PAGE_SIZE aligned");
+
 public:
-    explicit GrowingMemoryPool(size_t page_size = 1024 * 1024)
+    explicit GrowingMemoryPool(size_t page_size = 1024 * 1024, PageSourceType source = PageSourceType::Heap) : _source(source)
     {
         if (page_size < MIN_PAGE_SIZE) page_size = MIN_PAGE_SIZE;
 
-        _page_size = ((page_size + MIN_PAGE_SIZE) / MIN_PAGE_SIZE - 1) * MIN_PAGE_SIZE;
+        const size_t alignment = (source == PageSourceType::LargePages && PageSource::LargePageSize())
+            ? PageSource::LargePageSize() : MIN_PAGE_SIZE;
+
+        _page_size = (page_size + alignment - 1) / alignment * alignment;
     }
 
     ~GrowingMemoryPool() = default;
@@ -64,7 +157,7 @@ public:
     template<typename... Args>
     Type* construct(Args&&... args)
     {
-        const auto memory = allocateMemory(sizeof(Type));
+        const auto memory = allocateMemory(sizeof(Type), alignof(Type));
 
         return new (memory) Type(std::forward<Args>(args)...);
     }
@@ -72,11 +165,18 @@ public:
     Type* allocate(size_t n = 1)
     {
         if constexpr (sizeof(Type) > 1)
-            return reinterpret_cast<Type*>(allocateMemory(n * sizeof(Type)));
+            return reinterpret_cast<Type*>(allocateMemory(n * sizeof(Type), alignof(Type)));
         else
             return reinterpret_cast<Type*>(allocateMemory(n));
     }
 
+    // for mixed-type tables, the pool iterator is only meaningful for Type
+    template<typename T>
+    T* allocate(size_t n, size_t alignment = alignof(T))
+    {
+        return reinterpret_cast<T*>(allocateMemory(n * sizeof(T), alignment));
+    }
+
     void checkpoint()
     {
         if (_pages.empty())
@@ -115,7 +215,7 @@ public:
 
             while (_pages.size() > checkpoint._page + 1)
             {
-                _pages.pop_back();
+                recyclePage();
             }
 
             if (!_pages.empty() && _pages.size() == checkpoint._page + 1)
@@ -125,39 +225,104 @@ public:
         }
     }
     
+    // pages go to the free list, call trim() to return them to the system
     void release()
     {
         CheckpointsType().swap(_checkpoints);
 
-        PagesType().swap(_pages);
+        while (!_pages.empty()) recyclePage();
+    }
+
+    void trim(size_t keep_pages = 0)
+    {
+        while (_free.size() > keep_pages)
+        {
+            _reserved -= _free.back()->_size; _free.pop_back();
+        }
+    }
+
+    // bytes taken from the page source, including recycled pages
+    size_t Reserved() const
+    {
+        return _reserved;
+    }
+
+    size_t Used() const
+    {
+        size_t used = 0;
+
+        for (const auto& page : _pages) used += page->_used;
+
+        return used;
+    }
+
+    size_t FreePages() const
+    {
+        return _free.size();
     }
 
 private:
 
+    void recyclePage()
+    {
+        _pages.back()->_used = 0;
+
+        _free.push_back(std::move(_pages.back())); _pages.pop_back();
+    }
+
     MemoryPage& allocatePage(size_t size)
     {
-        return *_pages.emplace_back(std::make_unique<MemoryPage>(size)).get();
+        // best fit, large-object pages are recycled only for requests of a similar size
+        size_t best = _free.size();
+
+        for (size_t i = 0; i < _free.size(); i++)
+        {
+            const auto fs = _free[i]->_size;
+
+            if (fs >= size && fs / 2 < size && (best == _free.size() || fs < _free[best]->_size))
+            {
+                best = i; if (fs == size) break;
+            }
+        }
+
+        if (best != _free.size())
+        {
+            std::swap(_free[best], _free.back());
+
+            _pages.push_back(std::move(_free.back())); _free.pop_back();
+
+            return *_pages.back().get();
+        }
+
+        _reserved += size;
+
+        return *_pages.emplace_back(std::make_unique<MemoryPage>(size, _source)).get();
     }
 
-    void* allocateMemory(size_t size = 1)
+    void* allocateMemory(size_t size = 1, size_t alignment = 1)
     {
         if (size == 0) return nullptr;
 
-        assert(size <= _page_size);
+        mz_assert(alignment != 0 && (alignment & (alignment - 1)) == 0 && alignment <= MIN_PAGE_SIZE);
 
         if (_pages.size() > 0)
         {
             auto& page = *_pages.back().get();
 
-            if (page._used + size <= page._size)
+            const auto offset = (page._used + alignment - 1) & ~(alignment - 1);
+
+            if (offset + size <= page._size)
             {
-                auto* ptr = static_cast<char*>(page._ptr) + page._used;
+                auto* ptr = static_cast<char*>(page._ptr) + offset;
 
-                page._used += size; return ptr;
+                page._used = offset + size; return ptr;
             }
         }
 
-        auto& np = allocatePage(_page_size);
+        // dedicated large-object page, page start is always MIN_PAGE_SIZE aligned
+        const auto page_size = (size > _page_size) ? (size + MIN_PAGE_SIZE - 1) / MIN_PAGE_SIZE * MIN_PAGE_SIZE : _page_size;
+
+        auto& np = allocatePage(page_size);
 
         np._used = size; return np._ptr;
     }
@@ -169,12 +334,17 @@ private:
 
     __forceinline size_t GetLastPageIndex() const
     {
-        return _pages.size() - 1;
+        return _pages.empty() ? 0 : _pages.size() - 1;
     }
 
     __forceinline size_t GetLastPageOffset() const
     {
-        return _pages[GetLastPageIndex()]->_used;
+        return _pages.empty() ? 0 : _pages[GetLastPageIndex()]->_used;
+    }
+
+    __forceinline size_t GetPageUsed(size_t page) const
+    {
+        return _pages[page]->_used;
     }
 
     const Type* getType(size_t page, size_t offset) const
@@ -208,26 +378,18 @@ private:
         {
             offset += sizeof(Type);
 
-            if ((offset + sizeof(Type)) < pool->GetPageSize())
+            // pages have different sizes (large-object pages), the last page stops at end()
+            while ((offset + sizeof(Type)) > pool->GetPageUsed(page) && page < pool->GetLastPageIndex())
             {
-                return *this;
+                offset = 0; page++;
             }
 
-            offset = 0; page++; return *this;
+            return *this;
         }
 
         iterator operator++(int)
         {
-            iterator tmp = *this;
-
-            offset += sizeof(Type);
-
-            if ((offset + sizeof(Type)) < pool->GetPageSize())
-            {
-                return tmp;
-            }
-            
-            offset = 0; page++; return tmp;
+            iterator tmp = *this; ++(*this); return tmp;
         }
 
         bool operator==(const iterator& other) const
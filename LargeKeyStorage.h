@@ -1,10 +1,22 @@
 #pragma once
 
+#include <bit>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
 #include "SimdHash.h"
 #include "RangeMapper.h"
+#include "PartitionedKeyIndex.h"
 #include "Assert.h"
 #include "FileSystem.h"
 #include "ExternalStructSort.h"
+#include "AlignedAllocator.h"
+#include "WriteBehindLog.h"
+#include "ReadAheadRing.h"
+#include "Metrics.h"
+#include "SimilarityIndex.h"
+#include "IntegerCodec.h"
 
 #define XXH_VECTOR XXH_AVX2
 #include "xxHash3\xxh3.h"
@@ -17,12 +29,50 @@
 
 //#define SIZE_IN_SMALL_KEY
 
+// skIndex 64 бит: hi до 2^40 уникальных фрагментов вместо 2^31, FragmentInfo 44 байта
+// hi: tag 1 + realIndex 4/8 + key 8 байт на слот, 13.6 -> 17.8 B/key (+31%)
+// 16M ключей, Add/TryGetIndex ~6/~11 Mops в обоих вариантах (Linux VM, 1 ядро, g++ -O2), fi.log не меняется (varint)
+//#define WIDE_SK_INDEX
+
+// hiCollision и селекторы: smallKey в плотном массиве, хвост l1..l3 отдельно, см. SimdHash::IndexArraySoA
+// 4M ключей: Add/hit/miss в пределах шума (+-8%, g++ -O2), у коллизий hiCollision smallKey совпадает и хвост читается всегда
+//#define LARGE_KEY_SOA
+
+// hi на диске: partitions по старшим битам Mix(smallKey), в памяти summary + LRU, см. PartitionedKeyIndex
+//#define PARTITIONED_HI
+
+// такты по фазам, байты, попадания, гистограммы записи; 0 - замеры компилируются в пустоту
+#define LKS_METRICS 1
+
+// near-duplicate: super-features новых фрагментов, Add отдает skIndex похожей базы для FragmentDelta
+// sketch ~3 такта/байт (g++ -O2) только для новых фрагментов, 3 записи SimdHash::Map на уникальный фрагмент
+//#define SIMILAR_FRAGMENTS
+
+#if LKS_METRICS
+#define LKS_SCOPE(name) MZ::ScopedCycles<decltype(metrics.name)> scope_##name(metrics.name)
+#define LKS_COUNT(name, value) metrics.name.Add(value)
+#else
+#define LKS_SCOPE(name)
+#define LKS_COUNT(name, value)
+#endif
+
 namespace MZ
 {
+#if defined(WIDE_SK_INDEX)
+    using SkIndex = uint64_t;
+#else
+    using SkIndex = uint32_t;
+#endif
+
 #pragma pack(push, 1)
 
     struct LargeKey
     {
+        // narrow: [sIndex:32, cIndex:31, flag:1=0], wide: [sIndex:40, cIndex:23, flag:1=0]
+        static constexpr uint32_t SkIndexShift = (sizeof(SkIndex) == 8) ? 24 : 32;
+
+        static constexpr uint32_t MaxCollisionIndex = (1u << (SkIndexShift - 1)) - 1;
+
         __inline bool operator==(const LargeKey& lk) const
         {
             return smallKey == lk.smallKey && shortCmp(lk);
@@ -54,17 +104,17 @@ namespace MZ
 
         __inline uint32_t collision_index() const
         {
-            return static_cast<uint32_t>(smallKey) >> 1; // 31 бит [31...1]
+            return static_cast<uint32_t>(smallKey >> 1) & MaxCollisionIndex; // 31 (23) бит [31...1]
         }
 
-        __inline uint32_t sk_index() const
+        __inline SkIndex sk_index() const
         {
-            return static_cast<uint32_t>(smallKey >> 32); // 32 бита [63...32]
+            return static_cast<SkIndex>(smallKey >> SkIndexShift); // 32 (40) бит [63...32]
         }
 
-        __inline void index(uint32_t collisionIndex, uint32_t skIndex)
+        __inline void index(uint32_t collisionIndex, SkIndex skIndex)
         {
-            smallKey = static_cast<uint64_t>(skIndex) << 32 | ((collisionIndex & 0x7FFFFFFFULL) << 1);
+            smallKey = static_cast<uint64_t>(skIndex) << SkIndexShift | ((collisionIndex & static_cast<uint64_t>(MaxCollisionIndex)) << 1);
         }
 
 #if defined(SIZE_IN_SMALL_KEY)
@@ -94,16 +144,23 @@ namespace MZ
     {
         __inline bool operator==(const FragmentInfoKey& key) const
         {
+#if defined(WIDE_SK_INDEX)
+            return _Low == key._Low && _High == key._High && _Ext == key._Ext;
+#else
             return _Low == key._Low && _High == key._High;
+#endif
         }
 
         uint64_t _Low;
         uint64_t _High;
+#if defined(WIDE_SK_INDEX)
+        uint32_t _Ext;
+#endif
     };
 
     struct FragmentInfo
     {
-        uint32_t skIndex;
+        SkIndex skIndex;
         uint32_t fileIndex;
 
         union
@@ -123,15 +180,294 @@ namespace MZ
 
     static_assert(sizeof(LargeKey) == 32, "LargeKey must be 32 bytes");
 
-    static_assert(sizeof(FragmentInfo) == 40, "FragmentInfo must be 40 bytes");
+    static_assert(sizeof(FragmentInfo) == 32 + sizeof(SkIndex) + 4, "FragmentInfo must be 40 bytes (44 for WIDE_SK_INDEX)");
+
+    static_assert(sizeof(FragmentInfoKey) == sizeof(SkIndex) + 4 + 8, "FragmentInfoKey must cover skIndex, fileIndex, fileOffset");
+
+    // fi.log и fi.run: tag, [fileIndex], offset, [l1, l2, l3]
+    // tag = zigzag(skIndex - prev[skIndex >> RegionShift]) << 5 | region << 3 | bTail << 2 | bSameFile << 1 | 1
+    // fileIndex и offset delta к предыдущей записи, хвост ключа только если он нужен ResolveCollisions
+    class FragmentInfoCodec
+    {
+        SkIndex prevSkIndex[4];
+
+        uint32_t prevFileIndex;
+
+        int64_t prevOffset;
+
+        static __forceinline uint8_t* PutVarInt(uint64_t value, uint8_t* out)
+        {
+            for (; value >= 0x80; value >>= 7) *out++ = static_cast<uint8_t>(value) | 0x80;
+
+            *out++ = static_cast<uint8_t>(value); return out;
+        }
+
+        static __forceinline const uint8_t* GetVarInt(const uint8_t* in, uint64_t& value)
+        {
+            value = 0;
+
+            for (uint32_t shift = 0; ; shift += 7)
+            {
+                const uint64_t byte = *in++; value |= (byte & 0x7F) << shift;
+
+                if (byte < 0x80) return in;
+            }
+        }
+
+        static __forceinline uint64_t ZigZag(int64_t value)
+        {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        static __forceinline int64_t UnZigZag(uint64_t value)
+        {
+            return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+        }
+
+    public:
+
+        static constexpr size_t MaxSize = 10 + 5 + 10 + 24;
+
+        // HashIndexType::MAX_SIZE / 2: 2^30 или 2^39 для WIDE_SK_INDEX
+        static constexpr uint32_t RegionShift = (sizeof(SkIndex) == 8) ? 39 : 30;
+
+        FragmentInfoCodec()
+        {
+            Reset();
+        }
+
+        void Reset()
+        {
+            // регионы: hi, hi, lhSelector[1], lhSelector[0], delta внутри региона < 2^RegionShift
+            for (uint32_t i = 0; i < 4; i++) prevSkIndex[i] = static_cast<SkIndex>(i) << RegionShift;
+
+            prevFileIndex = 0; prevOffset = 0;
+        }
+
+        // хвост не пишется если при Add ключ совпал полностью, см. AddToSelector
+        static __inline bool HasTail(const FragmentInfo& fi)
+        {
+            return (fi.lk.l1 | fi.lk.l2 | fi.lk.l3) != 0;
+        }
+
+        uint8_t* Encode(const FragmentInfo& fi, uint8_t* out)
+        {
+            const auto region = static_cast<uint32_t>(fi.skIndex >> RegionShift);
+
+            const auto delta = static_cast<std::make_signed_t<SkIndex>>(fi.skIndex - prevSkIndex[region]);
+
+            const bool bTail = HasTail(fi), bSameFile = fi.fileIndex == prevFileIndex;
+
+            out = PutVarInt(ZigZag(delta) << 5 | region << 3 | bTail << 2 | bSameFile << 1 | 1, out);
+
+            if (!bSameFile) out = PutVarInt(ZigZag(static_cast<int32_t>(fi.fileIndex - prevFileIndex)), out);
+
+            out = PutVarInt(ZigZag(bSameFile ? fi.fileOffset - prevOffset : fi.fileOffset), out);
+
+            if (bTail)
+            {
+                std::memcpy(out, &fi.lk.l1, 24); out += 24;
+            }
+
+            prevSkIndex[region] = fi.skIndex; prevFileIndex = fi.fileIndex; prevOffset = fi.fileOffset;
+
+            return out;
+        }
+
+        const uint8_t* Decode(const uint8_t* in, FragmentInfo& fi)
+        {
+            uint64_t tag, value;
+
+            in = GetVarInt(in, tag);
+
+            const auto region = static_cast<uint32_t>(tag >> 3) & 3;
+
+            fi.skIndex = prevSkIndex[region] + static_cast<SkIndex>(UnZigZag(tag >> 5));
+
+            fi.fileIndex = prevFileIndex;
+
+            if (!(tag & 2))
+            {
+                in = GetVarInt(in, value); fi.fileIndex += static_cast<uint32_t>(UnZigZag(value));
+            }
+
+            in = GetVarInt(in, value); fi.fileOffset = UnZigZag(value) + ((tag & 2) ? prevOffset : 0);
+
+            if (tag & 4)
+            {
+                std::memcpy(&fi.lk.l1, in, 24); in += 24;
+            }
+            else
+            {
+                fi.lk.l1 = fi.lk.l2 = fi.lk.l3 = 0;
+            }
+
+            prevSkIndex[region] = fi.skIndex; prevFileIndex = fi.fileIndex; prevOffset = fi.fileOffset;
+
+            return in;
+        }
+    };
+
+    // число fi по fileIndex для GetFileIndexInfo: Buckets корзин по 1 << shift индексов,
+    // когда fileIndex выходит за последнюю корзину, соседние корзины сливаются попарно
+    class FileIndexHistogram
+    {
+    public:
+
+        static constexpr uint32_t Buckets = 4096;
+
+    private:
+
+        std::vector<size_t> counts = std::vector<size_t>(Buckets, 0);
+
+        uint32_t shift = 0;
+
+    public:
+
+        __forceinline void Add(uint32_t fileIndex)
+        {
+            while ((fileIndex >> shift) >= Buckets)
+            {
+                for (uint32_t i = 0; i < Buckets / 2; i++) counts[i] = counts[i * 2] + counts[i * 2 + 1];
+
+                std::fill(counts.begin() + Buckets / 2, counts.end(), size_t(0)); shift++;
+            }
+
+            counts[fileIndex >> shift]++;
+        }
+
+        __forceinline uint32_t Bucket(uint32_t fileIndex) const
+        {
+            return fileIndex >> shift;
+        }
+
+        // корзина -> partition, границы по квантилям числа записей, partition не пустые
+        // корзина не делится, поэтому partition может быть больше total / partitions
+        uint32_t Split(uint32_t partitions, size_t total, std::vector<uint16_t>& partitionOf) const
+        {
+            partitionOf.assign(Buckets, 0);
+
+            uint32_t partition = 0; size_t sum = 0, quantile = 0;
+
+            for (uint32_t i = 0; i < Buckets; i++)
+            {
+                // новая partition с первой непустой корзины следующего квантиля
+                if (counts[i] && sum * partitions / total > quantile)
+                {
+                    quantile = sum * partitions / total; partition++;
+                }
+
+                partitionOf[i] = static_cast<uint16_t>(partition); sum += counts[i];
+            }
+
+            return partition + 1;
+        }
+    };
+
+    // bitmap живых skIndex для LargeKeyStorage::Retire
+    // Mark можно звать параллельно, например из eventReady в GetFileIndexInfo
+    class LiveFragments
+    {
+        std::vector<std::atomic<uint64_t>> bits;
+
+    public:
+
+        explicit LiveFragments(SkIndex count) : bits((static_cast<size_t>(count) + 63) / 64) {}
+
+        __forceinline void Mark(SkIndex skIndex)
+        {
+            auto& word = bits[skIndex >> 6]; const auto bit = 1ull << (skIndex & 63);
+
+            if (!(word.load(std::memory_order_relaxed) & bit)) word.fetch_or(bit, std::memory_order_relaxed);
+        }
+
+        void Mark(const std::vector<SkIndex>& fragmentIndex)
+        {
+            for (const auto skIndex : fragmentIndex) Mark(skIndex);
+        }
+
+        __forceinline bool Test(SkIndex skIndex) const
+        {
+            return (skIndex >> 6) < bits.size() && (bits[skIndex >> 6].load(std::memory_order_relaxed) >> (skIndex & 63)) & 1;
+        }
+
+        SkIndex Count() const
+        {
+            SkIndex count = 0;
+
+            for (const auto& word : bits) count += std::popcount(word.load(std::memory_order_relaxed));
+
+            return count;
+        }
+    };
+
+    // все поля можно читать из другого потока во время ingest, см. Metrics.h
+    struct LargeKeyStorageMetrics
+    {
+        MetricsClock clock;
+
+        CycleCounter hash, sketch, probe, getLargeKeys, chunkSort, merge, fileIndexInfo, retire;
+
+        Counter bytesHashed, fragments, unique, hiHits, cacheHits, cacheFills, similarHits;
+
+        LatencyHistogram flush; // Push в WriteBehindLog (ожидание свободного слота) и WriteToDisk
+
+        std::string ToJson() const
+        {
+            const auto seconds = clock.Seconds();
+
+            const auto hitRatio = fragments.Value() ? 1.0 - static_cast<double>(unique.Value()) / fragments.Value() : 0.0;
+
+            const auto cacheRatio = (cacheHits.Value() + hiHits.Value()) ? static_cast<double>(cacheHits.Value()) / (cacheHits.Value() + hiHits.Value()) : 0.0;
+
+            std::string json = "{";
+
+            json += "\"seconds\":" + std::to_string(seconds) + ",\"tsc_hz\":" + std::to_string(clock.CyclesPerSecond()) + ",";
+
+            json += "\"fragments_per_second\":" + std::to_string(seconds > 0 ? fragments.Value() / seconds : 0.0) + ",";
+
+            json += "\"hit_ratio\":" + std::to_string(hitRatio) + ",\"cache_hit_ratio\":" + std::to_string(cacheRatio) + ",";
+
+            bytesHashed.AppendJson(json, "bytes_hashed"); json += ",";
+            fragments.AppendJson(json, "fragments"); json += ",";
+            unique.AppendJson(json, "unique"); json += ",";
+            hiHits.AppendJson(json, "hi_hits"); json += ",";
+            cacheHits.AppendJson(json, "cache_hits"); json += ",";
+            cacheFills.AppendJson(json, "cache_fills"); json += ",";
+            similarHits.AppendJson(json, "similar_hits"); json += ",";
+
+            hash.AppendJson(json, "hash"); json += ",";
+            sketch.AppendJson(json, "sketch"); json += ",";
+            probe.AppendJson(json, "probe"); json += ",";
+            getLargeKeys.AppendJson(json, "get_large_keys"); json += ",";
+            chunkSort.AppendJson(json, "chunk_sort"); json += ",";
+            merge.AppendJson(json, "merge"); json += ",";
+            fileIndexInfo.AppendJson(json, "file_index_info"); json += ",";
+            retire.AppendJson(json, "retire"); json += ",";
+
+            flush.AppendJson(json, "flush");
+
+            return json + "}";
+        }
+    };
 
 	class LargeKeyStorage
 	{
-        using HashIndexType = SimdHash::Index<uint64_t, SimdHash::Hash<uint64_t, SimdHash::HashType::Absl32>, SimdHash::Mode::Fast, true>;
+#if defined(PARTITIONED_HI)
+        using HashIndexType = PartitionedKeyIndex<SkIndex>;
+#else
+        using HashIndexType = SimdHash::Index<uint64_t, SimdHash::Hash<uint64_t, SimdHash::HashType::Absl32>, SimdHash::Equal<uint64_t>, SimdHash::Mode::Fast, true, SkIndex>;
+#endif
 
-        using HashIndexLargeKeyType = SimdHash::Index<LargeKey, SimdHash::Hash<LargeKey, SimdHash::HashType::Absl32>, SimdHash::Mode::Fast, true>;
+#if defined(LARGE_KEY_SOA)
+        using HashIndexLargeKeyType = SimdHash::Index<LargeKey, SimdHash::Hash<LargeKey, SimdHash::HashType::Absl32>, SimdHash::Equal<LargeKey>, SimdHash::Mode::Fast, true, uint32_t, true>;
+#else
+        using HashIndexLargeKeyType = SimdHash::Index<LargeKey, SimdHash::Hash<LargeKey, SimdHash::HashType::Absl32>, SimdHash::Equal<LargeKey>, SimdHash::Mode::Fast, true>;
+#endif
 
-        using MapType = SimdHash::Map<FragmentInfoKey, uint32_t>;
+        using MapType = SimdHash::Map<FragmentInfoKey, SkIndex>;
+
+        static_assert((static_cast<SkIndex>(2) << FragmentInfoCodec::RegionShift) == HashIndexType::MAX_SIZE, "RegionShift");
 
         HashIndexType hi;
 
@@ -141,57 +477,119 @@ namespace MZ
         {
             HashIndexLargeKeyType hi;
 
-            uint32_t index = 0;
+            SkIndex index = 0;
 
         } lhSelector[2];
 
-        RangeMapper rm;
+        RangeMapper<SkIndex> rm;
 
         blake3_hasher fragmentHasher;
 
         __declspec(align(64)) XXH3_state_t lksHasher;
 
-        std::vector<FragmentInfo> fiBuffer;
+        AlignedVector<uint8_t> fiBuffer; // FragmentInfoCodec
+
+        FragmentInfoCodec fiCodec;
+
+        size_t fiCount = 0;
+
+        FileIndexHistogram fiHistogram; // GetFileIndexInfo делит fi по квантилям fileIndex
+
+        AlignedVector<LargeKey> lkBuffer;
 
-        std::vector<LargeKey> lkBuffer;
+        File lkDatFile, fiLogFile, fiRunFile;
 
-        File lkDatFile, fiLogFile;
+        bool bSortedRuns = false; // fi.run заполнен в ResolveCollisions, skIndex уже remap
+
+        std::wstring lkDatPath, fiLogPath, fiRunPath;
+
+        // полные буферы пишутся в фоне, до Flush() файлы напрямую не трогаем
+        WriteBehindLog<uint8_t> fiLog{ fiLogFile };
+
+        // ключей в lk.dat: конец записи lkLog в его потоке, после ResolveCollisions / Retire - размер файла
+        std::atomic<SkIndex> lkDurable = 0;
+
+        WriteBehindLog<LargeKey> lkLog{ lkDatFile, 2, [this]() { lkDurable.store(static_cast<SkIndex>(lkDatFile.Position() / sizeof(LargeKey))); } };
 
         MapType fiReMap;
 
+        // locality cache: smallKey -> skIndex соседей lk.dat вокруг последнего попадания в hi
+        // lk.dat не меняется, поэтому кэш не устаревает, при переполнении просто чистится
+        SimdHash::Map<uint64_t, SkIndex, SimdHash::Hash<uint64_t, SimdHash::HashType::Absl32>> lkCache;
+
+        static constexpr SkIndex lkCacheRadius = 256;
+
+        static constexpr uint32_t lkCacheLimit = 64 * 1024;
+
+        // окна lk.dat читаются асинхронно, в lkCache попадают при завершении чтения (PollLocalityCache)
+        struct LocalityRead
+        {
+            std::vector<LargeKey> window;
+
+            SkIndex begin = 0, end = 0;
+
+            bool bBusy = false;
+        };
+
+        static constexpr uint32_t lkCacheReads = 4; // все в полете - новое окно пропускается
+
+        LocalityRead lkCacheRead[lkCacheReads];
+
+        File lkCacheReader; // после lkCacheRead: закрывается первым и дожидается чтений в window
+
+#if defined(SIMILAR_FRAGMENTS)
+        SimilarityIndex<SkIndex> similarIndex;
+
+        // super-features новых фрагментов блока, в similarIndex попадают в GetLargeKeys с финальным skIndex
+        std::vector<std::pair<FragmentSketch::SuperFeaturesType, SkIndex>> similarPending[2];
+#endif
+        LargeKeyStorageMetrics metrics;
+
     public:
 
         LargeKeyStorage(const wchar_t* logPath = nullptr)
         {
             // bLow == false
-            lhSelector[0].index = HashIndexType::MAX_SIZE + (static_cast<uint64_t>(HashIndexType::MAX_SIZE) * 2 - HashIndexType::MAX_SIZE) / 2;
+            lhSelector[0].index = HashIndexType::MAX_SIZE + (static_cast<SkIndex>(HashIndexType::MAX_SIZE) * 2 - HashIndexType::MAX_SIZE) / 2;
             // bLow == true
             lhSelector[1].index = HashIndexType::MAX_SIZE;
 
             blake3_hasher_init(&fragmentHasher);
 
-            fiBuffer.reserve(6 * find_aligment_for_4096(sizeof(FragmentInfo)));
+            fiBuffer.reserve(128 * 1024);
 
             lkBuffer.reserve(10 * find_aligment_for_4096(sizeof(LargeKey)));
 
-            std::wstring fiLogPath = L"fi.log", lkDataPath = L"lk.dat";
+            std::wstring lkDataPath = L"lk.dat";
+
+            fiLogPath = L"fi.log"; fiRunPath = L"fi.run";
 
             if (logPath != nullptr)
             {
-                fiLogPath = logPath + L'/' + fiLogPath;
+                fiLogPath = std::wstring(logPath) + L'/' + fiLogPath;
+
+                fiRunPath = std::wstring(logPath) + L'/' + fiRunPath;
             }
 
             fiLogFile.Create(fiLogPath.c_str(), true, false);
             assert(fiLogFile.IsOpen(), "%s\n", fiLogFile.GetLastErrorA().c_str());
 
+            fiRunFile.Create(fiRunPath.c_str(), true, false);
+            assert(fiRunFile.IsOpen(), "%s\n", fiRunFile.GetLastErrorA().c_str());
+
             if (logPath != nullptr)
             {
-                lkDataPath = logPath + L'/' + lkDataPath;
+                lkDataPath = std::wstring(logPath) + L'/' + lkDataPath;
             }
 
-            lkDatFile.Create(lkDataPath.c_str(), true, false);
+            lkDatPath = lkDataPath;
+
+            lkDatFile.Create(lkDatPath.c_str(), true, false);
             assert(lkDatFile.IsOpen(), "%s\n", lkDatFile.GetLastErrorA().c_str());
 
+#if defined(PARTITIONED_HI)
+            hi.Open((logPath != nullptr) ? std::wstring(logPath) + L'/' : std::wstring());
+#endif
             LargeKey lk = { 0 };
 
             hi.Add(lkBuffer.emplace_back(lk).smallKey);
@@ -204,7 +602,7 @@ namespace MZ
             return lhSelector[bLow].hi.Count();
         }
 
-        uint32_t Count() const
+        SkIndex Count() const
         {
             return hi.Count();
         }
@@ -214,13 +612,39 @@ namespace MZ
             return hiCollision.Count();
         }
 
-        __inline uint32_t remap(uint32_t input)
+#if LKS_METRICS // счетчики идут через LKS_COUNT, без метрик не ведутся
+        uint64_t LocalityHits() const
+        {
+            return metrics.cacheHits.Value();
+        }
+
+        uint64_t LocalityFills() const
+        {
+            return metrics.cacheFills.Value();
+        }
+#endif
+
+        // sampling from another thread is safe, values are cumulative since construction
+        const LargeKeyStorageMetrics& Metrics() const
+        {
+            return metrics;
+        }
+
+        std::string MetricsJson() const
+        {
+            return metrics.ToJson();
+        }
+
+        // в любом порядке, до ResolveCollisions: временный skIndex селектора -> skIndex в hi
+        __inline SkIndex remap(SkIndex input) const
         {
-            return (input <= HashIndexType::MAX_SIZE) ? input : rm.remap(input);
+            return (input <= HashIndexType::MAX_SIZE) ? input : rm.lookup(input);
         }
 
         void FragmentToLargeKey(const uint8_t* fragment, uint32_t fragmentSize, LargeKey& lk)
         {
+            LKS_SCOPE(hash); LKS_COUNT(bytesHashed, fragmentSize);
+
             blake3_hasher_reset(&fragmentHasher);
 #if DEBUG_FRAGMENT_SIZE
             blake3_hasher_update(&fragmentHasher, fragment, DEBUG_FRAGMENT_SIZE);
@@ -238,32 +662,112 @@ namespace MZ
 
         bool Add(const uint8_t* fragment, uint32_t fragmentSize, uint32_t fileIndex, int64_t fileOffset, bool bLow)
         {
-            FragmentInfo& fi = fiBuffer.emplace_back();
+            FragmentInfo fi;
 
             FragmentToLargeKey(fragment, fragmentSize, fi.lk);
             
-            const auto bResult = AddToSelector(fi, bLow);
+            bool bExact, bResult;
+
+            {
+                LKS_SCOPE(probe); bResult = AddToSelector(fi, bLow, bExact);
+            }
+
+            LKS_COUNT(fragments, 1); LKS_COUNT(unique, bResult);
 
             fi.fileIndex = fileIndex;
 
 #if !DEBUG_FRAGMENT_INFO
             fi.fileOffset = fileOffset;
 #endif
-            if (fiBuffer.size() == fiBuffer.capacity())
+            if (bExact) fi.lk.l1 = fi.lk.l2 = fi.lk.l3 = 0; // проверять нечего, хвост в лог не пишем
+
+            LogFragment(fi);
+
+            return bResult;
+        }
+
+#if defined(SIMILAR_FRAGMENTS)
+        // similar: skIndex похожего фрагмента из прошлых GetLargeKeys (база для FragmentDelta) или 0
+        // ищем только для новых фрагментов, дубликатам delta не нужна
+        bool Add(const uint8_t* fragment, uint32_t fragmentSize, uint32_t fileIndex, int64_t fileOffset, bool bLow, SkIndex& similar)
+        {
+            similar = 0;
+
+            if (!Add(fragment, fragmentSize, fileIndex, fileOffset, bLow)) return false;
+
+            FragmentSketch::SuperFeaturesType sf; bool bSketch;
+
             {
-                WriteToDisk(fiBuffer, fiLogFile);
+                LKS_SCOPE(sketch); bSketch = FragmentSketch::Compute(fragment, fragmentSize, sf);
             }
 
-            return bResult;
+            if (bSketch)
+            {
+                if (similarIndex.TryGetBase(sf, similar)) LKS_COUNT(similarHits, 1);
+
+                similarPending[bLow].emplace_back(sf, lhSelector[bLow].index);
+            }
+
+            return true;
         }
+#endif
 
     private:
 
-        template <typename T>
-        __inline void WriteToDisk(std::vector<T>& buffer, File& file)
+        void LogFragment(const FragmentInfo& fi)
+        {
+            if (fiBuffer.capacity() - fiBuffer.size() < FragmentInfoCodec::MaxSize)
+            {
+                // в фоне пишутся только целые страницы, хвост переносим в освободившийся буфер
+                uint8_t tail[4096];
+
+                const auto pages = fiBuffer.size() & ~size_t(4095), tailSize = fiBuffer.size() - pages;
+
+                std::memcpy(tail, fiBuffer.data() + pages, tailSize);
+
+                fiBuffer.resize(pages);
+
+                {
+                    LKS_SCOPE(flush); fiLog.Push(fiBuffer);
+                }
+
+                fiBuffer.insert(fiBuffer.end(), tail, tail + tailSize);
+            }
+
+            const auto size = fiBuffer.size();
+
+            fiBuffer.resize(size + FragmentInfoCodec::MaxSize);
+
+            fiBuffer.resize(fiCodec.Encode(fi, fiBuffer.data() + size) - fiBuffer.data());
+
+            fiCount++; fiHistogram.Add(fi.fileIndex);
+        }
+
+        // чтение в ExternalStructSort идет асинхронно, отдельным дескриптором с FILE_FLAG_OVERLAPPED / io_uring
+        static void OpenReader(File& file, const std::wstring& path)
+        {
+            assert(file.OpenReadOverlapped(path.c_str()), "%s\n", file.GetLastErrorA().c_str());
+        }
+
+        // дописываем fi.log до конца: нулевой байт сбрасывает кодек, страница добивается нулями
+        void FlushFragmentLog()
+        {
+            fiLog.Flush();
+
+            if (fiBuffer.size() == fiBuffer.capacity()) WriteToDisk(fiBuffer, fiLogFile);
+
+            fiBuffer.push_back(0); WriteToDisk(fiBuffer, fiLogFile);
+
+            fiCodec.Reset();
+        }
+
+        template <typename T, typename A>
+        __inline void WriteToDisk(std::vector<T, A>& buffer, File& file)
         {
             if (buffer.size() > 0)
             {
+                LKS_SCOPE(flush);
+
                 if (buffer.size() != buffer.capacity())
                 {
                     constexpr auto min_size = find_aligment_for_4096(sizeof(T));
@@ -300,7 +804,7 @@ namespace MZ
 
                 if (lkBuffer.size() == lkBuffer.capacity())
                 {
-                    WriteToDisk(lkBuffer, lkDatFile);
+                    lkLog.Push(lkBuffer);
                 }
 
                 if (!clk.hasSize())
@@ -318,13 +822,93 @@ namespace MZ
 
 private:
 
-        bool AddToSelector(FragmentInfo& fi, bool bLow)
+        // соседние фрагменты файла обычно совпадают с соседними фрагментами прошлой версии,
+        // поэтому сначала кэш, а при попадании в hi читаем окно lk.dat [skIndex - R, skIndex + R)
+        __inline bool FindSmallKey(uint64_t smallKey, SkIndex& skIndex)
+        {
+            if (lkCacheReader.InFlight()) PollLocalityCache(0);
+
+            if (lkCache.TryGetValue(smallKey, skIndex))
+            {
+                LKS_COUNT(cacheHits, 1); return true;
+            }
+
+            if (!hi.TryGetIndex(smallKey, skIndex)) return false;
+
+            LKS_COUNT(hiHits, 1);
+
+            FillLocalityCache(skIndex); return true;
+        }
+
+        // запрос чтения окна, поток ingest не ждет, окно с skIndex уже в полете - второй раз не читаем
+        void FillLocalityCache(SkIndex skIndex)
+        {
+            // читаем только то, что уже лежит в lk.dat, хвост еще в lkBuffer / lkLog
+            const auto durable = lkDurable.load(std::memory_order_relaxed);
+
+            const auto begin = (skIndex > lkCacheRadius) ? skIndex - lkCacheRadius : 0;
+
+            const auto end = std::min<SkIndex>(skIndex + lkCacheRadius, durable);
+
+            if (begin >= end) return;
+
+            if (!lkCacheReader.IsOpen())
+            {
+                assert(lkCacheReader.OpenReadOverlapped(lkDatPath.c_str(), true, false), "%s\n", lkCacheReader.GetLastErrorA().c_str());
+            }
+
+            uint32_t slot = lkCacheReads;
+
+            for (uint32_t i = 0; i < lkCacheReads; i++)
+            {
+                const auto& read = lkCacheRead[i];
+
+                if (!read.bBusy) slot = i; else if (skIndex >= read.begin && skIndex < read.end) return;
+            }
+
+            if (slot == lkCacheReads) return;
+
+            auto& read = lkCacheRead[slot];
+
+            read.window.resize(end - begin); read.begin = begin; read.end = end;
+
+            read.bBusy = lkCacheReader.SubmitRead(reinterpret_cast<uint8_t*>(read.window.data()),
+                static_cast<uint32_t>(read.window.size() * sizeof(LargeKey)), static_cast<int64_t>(begin) * sizeof(LargeKey), slot);
+        }
+
+        // завершенные чтения окон -> lkCache, minComplete == 0 не ждет
+        void PollLocalityCache(uint32_t minComplete)
+        {
+            lkCacheReader.Complete([this](uint64_t slot, int32_t result)
+                {
+                    auto& read = lkCacheRead[slot]; read.bBusy = false;
+
+                    if (result <= 0) return;
+
+                    const auto count = static_cast<size_t>(result) / sizeof(LargeKey);
+
+                    if (lkCache.Count() + count > lkCacheLimit) lkCache.Clear();
+
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        // нули: добивка последней страницы в WriteToDisk
+                        if (read.window[i].smallKey) lkCache.AddOrUpdate(read.window[i].smallKey, read.begin + static_cast<SkIndex>(i));
+                    }
+
+                    LKS_COUNT(cacheFills, 1);
+                }, minComplete);
+        }
+
+        // bExact == false: совпал только smallKey, ResolveCollisions сверит хвост с lk.dat
+        bool AddToSelector(FragmentInfo& fi, bool bLow, bool& bExact)
         {
-            if (hi.TryGetIndex(fi.lk.smallKey, fi.skIndex))
+            if (FindSmallKey(fi.lk.smallKey, fi.skIndex))
             {
                 uint32_t ckIndex;
 
-                if (hiCollision.TryGetIndex(fi.lk, ckIndex))
+                bExact = hiCollision.TryGetIndex(fi.lk, ckIndex);
+
+                if (bExact)
                 {
                     fi.lk.index(ckIndex, fi.skIndex);
 
@@ -334,9 +918,13 @@ private:
                 return false;
             }
 
+            bExact = true;
+
             auto& selector = lhSelector[bLow];
 
-            if (selector.hi.TryAdd(fi.lk, fi.skIndex))
+            uint32_t index; // индекс селектора всегда 32 бита
+
+            if (selector.hi.TryAdd(fi.lk, index))
             {
                 fi.skIndex = ++selector.index;
                 
@@ -344,7 +932,7 @@ private:
             }
 
             // дубликат, уже есть в слекторе
-            fi.skIndex += (selector.index - selector.hi.Count() + 1);
+            fi.skIndex = index + (selector.index - selector.hi.Count() + 1);
             
             return false;
         }
@@ -377,19 +965,28 @@ public:
         // возвращаем ключи блока и текущий fingerprint
         uint64_t GetLargeKeys(std::vector<LargeKey>& buffer, bool bLow)
         {
-            uint32_t startIndex = hi.Count(), skIndex, ckIndex;
+            LKS_SCOPE(getLargeKeys);
+
+            SkIndex startIndex = hi.Count(), skIndex;
+            
+            uint32_t ckIndex;
 
             auto& selector = lhSelector[bLow];
 
             buffer.resize(0); assert(selector.hi.Count() != 0);
 
+#if defined(PARTITIONED_HI)
+            // нерезидентные partitions загружаются один раз на блок, а не на каждый ключ
+            hi.Resolve(selector.hi.Count(), [&selector](size_t i) { return selector.hi.GetKey(static_cast<uint32_t>(i)).smallKey; });
+#endif
+
             for (const auto& clk : selector.hi)
             {
                 auto& lk = lkBuffer.emplace_back(clk);
 
                 if (!hi.TryAdd(lk.smallKey, skIndex))
                 {
-                    assert(hiCollision.TryAdd(lk, ckIndex));
+                    assert(hiCollision.TryAdd(lk, ckIndex) && ckIndex <= LargeKey::MaxCollisionIndex);
 
                     lk.index(ckIndex, skIndex);
 
@@ -398,7 +995,7 @@ public:
 
                 if (lkBuffer.size() == lkBuffer.capacity())
                 {
-                    WriteToDisk(lkBuffer, lkDatFile);
+                    LKS_SCOPE(flush); lkLog.Push(lkBuffer);
                 }
 
                 buffer.push_back(clk); // только оригинальные ключи
@@ -407,6 +1004,12 @@ public:
             const auto size = static_cast<uint32_t>(buffer.size());
 
             rm.addRange(bLow, selector.index + 1 - size, startIndex, size);
+
+#if defined(SIMILAR_FRAGMENTS)
+            for (const auto& [sf, index] : similarPending[bLow]) similarIndex.Add(sf, startIndex + (index - (selector.index + 1 - size)));
+
+            similarPending[bLow].resize(0);
+#endif
             
             selector.hi.Clear();
 
@@ -421,7 +1024,9 @@ public:
         {
             assert(lhSelector[0].hi.Count() == 0 && lhSelector[1].hi.Count() == 0 && fiReMap.Count() == 0);
 
-            WriteToDisk(fiBuffer, fiLogFile);
+            lkLog.Flush(); // барьер, дальше fi.log и lk.dat пишутся и читаются напрямую
+
+            FlushFragmentLog();
 
             const auto lk_in_last_page = ((lkBuffer.size() * sizeof(LargeKey)) % 4096) / sizeof(LargeKey);
 
@@ -440,54 +1045,82 @@ public:
                 WriteToDisk(lkBuffer, lkDatFile);
             }
 
-            MZ::ExternalStructSort<FragmentInfo> sorter(fiLogFile.Size(),
+            MZ::ExternalStructSort<FragmentInfo, FragmentInfoCodec> sorter(fiCount * sizeof(FragmentInfo),
                 [](const FragmentInfo& a, const FragmentInfo& b)
                 {
                     return a.skIndex < b.skIndex;
                 });
 
-            sorter.ChunkSort(fiLogFile, [this](FragmentInfo& record)
-                { 
-                    record.skIndex = rm.remap(record.skIndex);
-                });
+            File fiLogReader, fiRunReader; OpenReader(fiLogReader, fiLogPath);
+
+            // сортированные run'ы в fi.run, дальше их же читает GetFileIndexInfo
+            {
+                LKS_SCOPE(chunkSort);
+
+                // fi.log идет в порядке поступления, не skIndex: потоковый rm.remap тут не годится
+                sorter.ChunkSort(fiLogReader, fiRunFile, [this](FragmentInfo& record)
+                    {
+                        record.skIndex = remap(record.skIndex);
+                    });
+            }
+
+            bSortedRuns = true; OpenReader(fiRunReader, fiRunPath);
 
             rm.validate(++lhSelector[0].index, ++lhSelector[1].index);
 
-            lkDatFile.SeekBegin(0); assert(0 == (lkDatFile.Size() % 4096));
+            assert(0 == (lkDatFile.Size() % 4096));
 
-            uint32_t skIndexL = 0, skIndexR = 0, lkReadBufferSize = static_cast<uint32_t>(128ull * 1024 / sizeof(LargeKey));
+            // merge-join: fi идут по возрастанию skIndex, lk.dat читается навстречу последовательно
+            // большие блоки в полете, при прыжке дальше кольца чтение перезапускается с нужного блока
+            File lkReader; OpenReader(lkReader, lkDatPath);
 
-            std::vector<LargeKey> lkReadBuffer(lkReadBufferSize), lkTempBuffer(4096 / sizeof(LargeKey));
+            ReadAheadRing lkRing(lkReader, 8, 1024 * 1024);
 
-            SimdHash::Set<LargeKey> dup;
+            ReadAheadRing::Block lkBlock = { nullptr, 0, 0 };
 
-            uint32_t skIndex = 0, ckIndex = 0, hiIndexMaxValue = hi.Count();
-            
-            sorter.Sort(fiLogFile,
-                [&](const FragmentInfo& fi)
+            const auto lkCount = lkDatFile.Size() / sizeof(LargeKey);
+
+            const auto lkRingSpan = static_cast<int64_t>(lkRing.Depth()) * lkRing.BlockSize();
+
+            auto getLargeKey = [&](SkIndex skIndex) -> const LargeKey&
+            {
+                const auto offset = static_cast<int64_t>(skIndex) * sizeof(LargeKey);
+
+                while (offset >= lkBlock.offset + lkBlock.size)
                 {
-                    if (fi.skIndex == 0) return;
+                    const auto blockOffset = offset / lkRing.BlockSize() * lkRing.BlockSize();
 
-                    assert(fi.skIndex < hiIndexMaxValue,
-                        "lkReadBuffer: %u, fi.skIndex: %u / 0x%x, skIndexR: %u",
-                        (uint32_t)lkReadBuffer.size(), fi.skIndex, fi.skIndex, skIndexR);
+                    if (lkBlock.size) lkRing.Release();
 
-                    if (fi.skIndex >= skIndexR)
-                    {
-                        assert(lkReadBufferSize == lkReadBuffer.size());
+                    if (lkBlock.size == 0 || blockOffset > lkBlock.offset + lkRingSpan) lkRing.Start(blockOffset);
 
-                        const auto idx = fi.skIndex / lkReadBufferSize * lkReadBufferSize;
+                    lkBlock = lkRing.Acquire();
 
-                        lkReadBuffer.resize(lkDatFile.Read(idx, lkReadBuffer));
+                    assert(lkBlock.size != 0, "lk.dat EOF, skIndex: %llu\n", (uint64_t)skIndex);
+                }
 
-                        assert(lkReadBuffer.size() != 0);
+                return *reinterpret_cast<const LargeKey*>(lkBlock.data + (offset - lkBlock.offset));
+            };
 
-                        skIndexL = idx; skIndexR = idx + static_cast<uint32_t>(lkReadBuffer.size());
-                    }
+            SimdHash::Set<LargeKey> dup;
+
+            SkIndex skIndex = 0, hiIndexMaxValue = hi.Count();
+
+            uint32_t ckIndex = 0;
+
+            LKS_SCOPE(merge); // до конца ResolveCollisions, вместе с readAction/readyEvent и дозаписью lk.dat
+            
+            sorter.Sort(fiRunReader,
+                [&](const FragmentInfo& fi)
+                {
+                    if (fi.skIndex == 0) return;
 
-                    assert(fi.skIndex >= skIndexL && fi.skIndex < skIndexR);
+                    assert(fi.skIndex < hiIndexMaxValue && fi.skIndex < lkCount,
+                        "lkCount: %llu, fi.skIndex: %llu / 0x%llx",
+                        (uint64_t)lkCount, (uint64_t)fi.skIndex, (uint64_t)fi.skIndex);
 
-                    const auto& lk = lkReadBuffer[fi.skIndex % lkReadBufferSize];
+                    // копия: lkBlock освобождается на следующем getLargeKey
+                    const auto lk = getLargeKey(fi.skIndex);
 
 #if DEBUG_FRAGMENT_INFO
 
@@ -495,11 +1128,11 @@ public:
                     if (lk.hasSize()) // в lk.dat смешанные ключи, уникальные по sk
                     {
                         assert(lk.smallKey == fi.lk.smallKey, 
-                            "fi.skIndex: %u, skIndexR: %u, lkReadBuffer: %u",
-                            fi.skIndex, skIndexR, (uint32_t)lkReadBuffer.size());
+                            "fi.skIndex: %llu, lkCount: %llu",
+                            (uint64_t)fi.skIndex, (uint64_t)lkCount);
                     }
 #endif
-                    if (lk.shortCmp(fi.lk)) return; // проверяем колизию
+                    if (!FragmentInfoCodec::HasTail(fi) || lk.shortCmp(fi.lk)) return; // проверяем колизию
 
                     assert(lk.hasSize(), "EPRST/EKLMN"); // если hasSize()==false то глобальная EPRST/EKLMN!
 
@@ -536,7 +1169,7 @@ public:
 
                         readyEvent(fragmentSize, clk); // оригинальный ключ и fingerprint
 
-                        assert(hiCollision.TryAdd(clk, ckIndex));
+                        assert(hiCollision.TryAdd(clk, ckIndex) && ckIndex <= LargeKey::MaxCollisionIndex);
 
                         clk.index(ckIndex, fi.skIndex);
 
@@ -566,11 +1199,7 @@ public:
 
                     if (!bAddClk) // фрагмент изменился, есть в hi
                     {
-                        const auto idx = static_cast<uint32_t>(skIndex / lkTempBuffer.size() * lkTempBuffer.size());
-
-                        assert(lkTempBuffer.size() == lkDatFile.Read(idx, lkTempBuffer));
-
-                        const auto& _lk = lkTempBuffer[skIndex % lkTempBuffer.size()];
+                        const auto& _lk = lkKeys[skIndex];
 
                         assert(_lk.smallKey == clk.smallKey);
 
@@ -586,7 +1215,8 @@ public:
 #endif
                 });
 
-            
+            lkRing.Stop(); // дальше lk.dat дописывается
+
             //std::wcout << L"fiRemap.Count(): " << fiRemap.Count() << std::endl;
 
             if (lkBuffer.size())
@@ -601,79 +1231,326 @@ public:
                 lkBuffer.resize(0);
             }
 
+            lkDurable = static_cast<SkIndex>(lkDatFile.Size() / sizeof(LargeKey));
+
             return GetFingerPrint();
         }
 
-        void GetFileIndexInfo(const std::function<void(uint32_t fileIndex, const std::vector<uint32_t>& fragmentIndex)>& eventReady)
+        using FileIndexEventType = std::function<void(uint32_t fileIndex, const std::vector<SkIndex>& fragmentIndex)>;
+
+        // fi делятся по квантилям fileIndex (fiHistogram) на partitions, каждую сортирует и отдает свой поток
+        // partition больше partitionRecords (один огромный файл, скученные fileIndex) сортируется внешне, по одной за раз
+        // threads == 1: eventReady serially in ascending fileIndex order, as before partitioning
+        // threads > 1 (0 - all cores): eventReady is called concurrently and out of order
+        // once per file with all its fragments, a file with a fragment remapped to 0 by ResolveCollisions is skipped
+        void GetFileIndexInfo(const FileIndexEventType& eventReady, uint32_t threads = 1)
         {
-            MZ::ExternalStructSort<FragmentInfo> sorter(fiLogFile.Size(),
-            [](const FragmentInfo& a, const FragmentInfo& b)
-            {
-                if (a.fileIndex < b.fileIndex) return true;
+            LKS_SCOPE(fileIndexInfo);
 
-                if (a.fileIndex == b.fileIndex) return a.fileOffset < b.fileOffset;
+            if (!bSortedRuns) FlushFragmentLog();
 
-                return false;
-            });
+            if (fiCount == 0) return;
 
-            std::vector<uint32_t> fragmentIndex; fragmentIndex.reserve(16ull * 1024);
+            // число partitions зависит только от объема fi, в памяти одновременно не больше 16 partitions по 16 MB
+            constexpr size_t partitionRecords = 16ull * 1024 * 1024 / sizeof(FragmentInfo);
 
-            struct
+            if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+            threads = std::min(threads, 16u);
+
+            std::vector<uint16_t> partitionOf;
+
+            const auto partitions = fiHistogram.Split(static_cast<uint32_t>(std::clamp<size_t>((fiCount + partitionRecords - 1) / partitionRecords, 1, 256)), fiCount, partitionOf);
+
+            threads = std::min(threads, partitions);
+
+            std::vector<File> files(partitions);
+
+            std::vector<EncodedRecordWriter<FragmentInfo, FragmentInfoCodec>> writers(partitions);
+
+            std::vector<size_t> counts(partitions);
+
+            std::vector<int64_t> sizes(partitions);
+
+            for (uint32_t i = 0; i < partitions; i++)
             {
-                uint32_t    fileIndex = 0;
-                bool        bUse = true;
+                const auto path = fiLogPath + L'.' + std::to_wstring(i);
 
-            } current;
+                files[i].Create(path.c_str(), true, true);
+                assert(files[i].IsOpen(), "%s\n", files[i].GetLastErrorA().c_str());
 
-            std::function<void(FragmentInfo& record)> preSortAction = nullptr;
+                writers[i].Open(files[i], 0, 64 * 1024);
+            }
 
-            if (fiReMap.Count())
             {
-                preSortAction = [this](FragmentInfo& fi)
+                File fiReader; OpenReader(fiReader, bSortedRuns ? fiRunPath : fiLogPath);
+
+                EncodedRecordReader<FragmentInfo, FragmentInfoCodec> reader;
+
+                reader.Open(fiReader, 0, fiReader.Size(), 1024 * 1024);
+
+                FragmentInfo fi;
+
+                for (size_t i = 0; i < fiCount; i++)
                 {
-                    fiReMap.TryGetValue(fi.asKey(), fi.skIndex);
-                };
+                    assert(reader.Next(fi));
+
+                    const auto partition = partitionOf[fiHistogram.Bucket(fi.fileIndex)];
+
+                    writers[partition].Put(fi); counts[partition]++;
+                }
             }
-            
-            sorter.ChunkSort(fiLogFile, nullptr, [&](MZ::FragmentInfo& fi)
-            {
-                if (~0u == fi.fileIndex) return;
 
-                if (current.fileIndex == fi.fileIndex)
+            for (uint32_t i = 0; i < partitions; i++) sizes[i] = writers[i].Close();
+
+            writers.clear();
+
+            std::atomic<uint32_t> next = 0;
+
+            std::mutex externalSortMtx;
+
+            const auto byFile = [](const FragmentInfo& a, const FragmentInfo& b)
                 {
-                    if (current.bUse)
+                    return (a.fileIndex != b.fileIndex) ? a.fileIndex < b.fileIndex : a.fileOffset < b.fileOffset;
+                };
+
+            auto worker = [&]()
+            {
+                AlignedVector<FragmentInfo> records;
+
+                std::vector<SkIndex> fragmentIndex; fragmentIndex.reserve(16ull * 1024);
+
+                uint32_t fileIndex = 0; bool bUse = true;
+
+                // записи по (fileIndex, fileOffset), файл отдается после последнего фрагмента
+                const auto put = [&](const FragmentInfo& fi)
                     {
-                        if (fi.skIndex != 0)
+                        if (fragmentIndex.size() && fi.fileIndex != fileIndex)
                         {
-                            fiReMap.TryGetValue(fi.asKey(), fi.skIndex);
+                            if (bUse) eventReady(fileIndex, fragmentIndex);
 
-                            fragmentIndex.push_back(fi.skIndex);
+                            fragmentIndex.resize(0); bUse = true;
                         }
-                        else
+
+                        fileIndex = fi.fileIndex; bUse &= fi.skIndex != 0; fragmentIndex.push_back(fi.skIndex);
+                    };
+
+                const auto flush = [&]()
+                    {
+                        if (fragmentIndex.size() && bUse) eventReady(fileIndex, fragmentIndex);
+
+                        fragmentIndex.resize(0); bUse = true;
+                    };
+
+                for (uint32_t partition; (partition = next++) < partitions; )
+                {
+                    if (counts[partition] > partitionRecords)
+                    {
+                        std::lock_guard<std::mutex> lock(externalSortMtx);
+
+                        MZ::ExternalStructSort<FragmentInfo, FragmentInfoCodec> sorter(counts[partition] * sizeof(FragmentInfo), byFile, 128 * 1024 * 1024);
+
+                        File runFile;
+
+                        const auto runPath = fiLogPath + L'.' + std::to_wstring(partition) + L".run";
+
+                        runFile.Create(runPath.c_str(), true, true);
+                        assert(runFile.IsOpen(), "%s\n", runFile.GetLastErrorA().c_str());
+
+                        sorter.ChunkSort(files[partition], runFile, [this](FragmentInfo& fi)
+                            {
+                                if (fiReMap.Count()) fiReMap.TryGetValue(fi.asKey(), fi.skIndex);
+                            });
+
+                        files[partition].Close();
+
+                        sorter.Sort(runFile, put); flush();
+
+                        continue;
+                    }
+
+                    records.resize(counts[partition]);
+
+                    {
+                        EncodedRecordReader<FragmentInfo, FragmentInfoCodec> reader;
+
+                        reader.Open(files[partition], 0, sizes[partition], 256 * 1024);
+
+                        for (auto& fi : records)
                         {
-                            current.bUse = false;
+                            assert(reader.Next(fi));
                         }
                     }
+
+                    files[partition].Close();
+
+                    if (fiReMap.Count())
+                    {
+                        fiReMap.TryGetValues(records.size(),
+                            [&](size_t i) -> const FragmentInfoKey& { return records[i].asKey(); },
+                            [&](size_t i, SkIndex skIndex) { records[i].skIndex = skIndex; });
+                    }
+
+                    std::sort(records.begin(), records.end(), byFile);
+
+                    for (const auto& fi : records) put(fi);
+
+                    flush();
                 }
-                else
+            };
+
+            std::vector<std::thread> pool;
+
+            for (uint32_t i = 1; i < threads; i++)
+            {
+                pool.emplace_back(worker);
+            }
+
+            worker();
+
+            for (auto& thread : pool) thread.join();
+        }
+
+#if !defined(WIDE_SK_INDEX)
+        using EncodedFileIndexEventType = std::function<void(uint32_t fileIndex, uint32_t fragments, const std::vector<uint8_t>& encoded)>;
+
+        // GetFileIndexInfo для хранения списков: fragmentIndex в StreamVByte::EncodeDelta (IntegerCodec.h),
+        // кодируется в потоках GetFileIndexInfo, eventReady получает готовые байты
+        // восстановление: StreamVByte::DecodeDelta(encoded.data(), encoded.data() + encoded.size(), fragments, out)
+        void GetFileIndexInfo(const EncodedFileIndexEventType& eventReady, uint32_t threads = 1)
+        {
+            GetFileIndexInfo([&eventReady](uint32_t fileIndex, const std::vector<SkIndex>& fragmentIndex)
+                {
+                    thread_local std::vector<uint8_t> encoded;
+
+                    encoded.resize(0); StreamVByte::EncodeDelta(fragmentIndex.data(), fragmentIndex.size(), encoded);
+
+                    eventReady(fileIndex, static_cast<uint32_t>(fragmentIndex.size()), encoded);
+                }, threads);
+        }
+#endif
+
+        using RemapActionType = std::function<void(SkIndex oldIndex, SkIndex newIndex)>;
+
+        // mark-and-sweep между сессиями, после ResolveCollisions / GetFileIndexInfo, fi.log и fi.run после него не действительны
+        // живые ключи lk.dat сдвигаются к началу на месте (новый индекс <= старого), hi и hiCollision строятся заново
+        // remapAction(old, new) для каждого старого skIndex по возрастанию, new == 0 - ключ удален
+        SkIndex Retire(const LiveFragments& live, const RemapActionType& remapAction)
+        {
+            LKS_SCOPE(retire);
+
+            assert(lhSelector[0].hi.Count() == 0 && lhSelector[1].hi.Count() == 0);
+
+            lkLog.Flush();
+
+            WriteToDisk(lkBuffer, lkDatFile); // хвост прошлого Retire, пишется с начала последней страницы
+
+            const SkIndex count = hi.Count();
+
+            // оригинал живой коллизии тоже живой: из него восстанавливается smallKey коллизии, old -> new
+            SimdHash::Map<SkIndex, SkIndex> originals;
+
+            for (uint32_t ckIndex = 0; ckIndex < hiCollision.Count(); ckIndex++)
+            {
+                LargeKey lk = hiCollision.GetKey(ckIndex);
+
+                SkIndex original, entry;
+
+                assert(hi.TryGetIndex(lk.smallKey, original));
+
+                lk.index(ckIndex, original);
+
+                assert(hi.TryGetIndex(lk.smallKey, entry));
+
+                if (live.Test(entry)) originals.AddOrUpdate(original, 0);
+            }
+
+            hi.Clear(live.Count() + originals.Count() + 1); hiCollision.Clear(originals.Count());
+
+            if (lkCacheReader.InFlight()) PollLocalityCache(lkCacheReader.InFlight());
+
+            lkCache.Clear();
+
+#if defined(SIMILAR_FRAGMENTS)
+            similarIndex.Clear(); // базы старых skIndex, похожие фрагменты снова находятся после следующих GetLargeKeys
+#endif
+
+            File lkReader; OpenReader(lkReader, lkDatPath);
+
+            ReadAheadRing lkRing(lkReader, 8, 1024 * 1024); lkRing.Start(0);
+
+            // чтение всегда впереди записи, дописываем только целые страницы lkBuffer
+            lkDatFile.SeekBegin(0);
+
+            SkIndex skIndex = 0, newIndex;
+
+            for (auto block = lkRing.Acquire(); block.size != 0 && skIndex < count; lkRing.Release(), block = lkRing.Acquire())
+            {
+                const auto lks = reinterpret_cast<const LargeKey*>(block.data);
+
+                for (size_t i = 0; i < block.size / sizeof(LargeKey) && skIndex < count; i++, skIndex++)
                 {
-                    if (current.bUse && fragmentIndex.size())
+                    SkIndex original = 0;
+
+                    const bool bOriginal = originals.TryGetValue(skIndex, original);
+
+                    if (skIndex != 0 && !bOriginal && !live.Test(skIndex))
                     {
-                        eventReady(current.fileIndex, fragmentIndex);
+                        remapAction(skIndex, 0); continue;
                     }
 
-                    fragmentIndex.resize(0);
+                    auto& lk = lkBuffer.emplace_back(lks[i]);
+
+                    if (skIndex != 0 && !lk.hasSize())
+                    {
+                        assert(originals.TryGetValue(lk.sk_index(), original), "skIndex: %llu\n", (uint64_t)skIndex);
+
+                        LargeKey clk = lk; clk.smallKey = hi.GetKey(original);
 
-                    current = { fi.fileIndex, fi.skIndex != 0 };
+                        uint32_t ckIndex;
 
-                    if (current.bUse) fragmentIndex.push_back(fi.skIndex);
+                        assert(hiCollision.TryAdd(clk, ckIndex) && ckIndex <= LargeKey::MaxCollisionIndex);
+
+                        lk.index(ckIndex, original);
+                    }
+
+                    assert(hi.TryAdd(lk.smallKey, newIndex) && newIndex <= skIndex);
+
+                    if (bOriginal) originals.AddOrUpdate(skIndex, newIndex);
+
+                    if (lkBuffer.size() == lkBuffer.capacity())
+                    {
+                        lkDatFile.Write(lkBuffer); lkBuffer.resize(0);
+                    }
+
+                    remapAction(skIndex, newIndex);
                 }
-            });
+            }
+
+            lkRing.Stop();
+
+            assert(skIndex == count, "lk.dat: %llu of %llu\n", (uint64_t)skIndex, (uint64_t)count);
+
+            // как в ResolveCollisions: записи последней страницы остаются в lkBuffer, добивка нулями обрезается
+            // следующей записью, поэтому позиция возвращается на начало последней страницы
+            const auto lk_in_last_page = ((lkBuffer.size() * sizeof(LargeKey)) % 4096) / sizeof(LargeKey);
+
+            std::vector<LargeKey> temp(lkBuffer.end() - lk_in_last_page, lkBuffer.end());
 
-            if (current.bUse && fragmentIndex.size())
+            WriteToDisk(lkBuffer, lkDatFile);
+
+            assert(lkDatFile.Truncate(), "%s\n", lkDatFile.GetLastErrorA().c_str());
+
+            lkDurable = static_cast<SkIndex>(lkDatFile.Size() / sizeof(LargeKey));
+
+            if (lk_in_last_page)
             {
-                eventReady(current.fileIndex, fragmentIndex);
+                lkDatFile.SeekEnd(-4096);
+
+                lkBuffer.assign(temp.begin(), temp.end());
             }
+
+            return hi.Count();
         }
 	};
 }
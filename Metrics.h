@@ -0,0 +1,157 @@
+#pragma once
+
+#include <bit>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <intrin.h>
+
+namespace MZ
+{
+    // один писатель, читать можно из любого потока: relaxed load/store без lock-префикса
+    // значения только растут, читатель сам считает дельты между выборками
+    class Counter
+    {
+        std::atomic<uint64_t> value{ 0 };
+
+    public:
+
+        __forceinline void Add(uint64_t delta)
+        {
+            value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+
+        uint64_t Value() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+
+        void AppendJson(std::string& json, const char* name) const
+        {
+            json += "\""; json += name; json += "\":"; json += std::to_string(Value());
+        }
+    };
+
+    // суммарные такты __rdtsc и число замеров
+    class CycleCounter
+    {
+        Counter cycles, calls;
+
+    public:
+
+        __forceinline void Add(uint64_t delta)
+        {
+            cycles.Add(delta); calls.Add(1);
+        }
+
+        uint64_t Cycles() const
+        {
+            return cycles.Value();
+        }
+
+        uint64_t Calls() const
+        {
+            return calls.Value();
+        }
+
+        void AppendJson(std::string& json, const char* name) const
+        {
+            json += "\""; json += name; json += "\":{";
+
+            cycles.AppendJson(json, "cycles"); json += ","; calls.AppendJson(json, "calls"); json += "}";
+        }
+    };
+
+    // bucket i: [2^i, 2^(i+1)) тактов, bucket 0 включает 0
+    class LatencyHistogram
+    {
+        static constexpr uint32_t Buckets = 48;
+
+        Counter buckets[Buckets];
+
+        CycleCounter total;
+
+    public:
+
+        __forceinline void Add(uint64_t delta)
+        {
+            const auto bucket = std::min<uint32_t>(delta ? static_cast<uint32_t>(std::bit_width(delta)) - 1 : 0, Buckets - 1);
+
+            buckets[bucket].Add(1); total.Add(delta);
+        }
+
+        uint64_t Cycles() const
+        {
+            return total.Cycles();
+        }
+
+        uint64_t Calls() const
+        {
+            return total.Calls();
+        }
+
+        // пустые buckets в начале и в конце не пишем: "log2":{"12":3,...}
+        void AppendJson(std::string& json, const char* name) const
+        {
+            json += "\""; json += name; json += "\":{";
+
+            total.AppendJson(json, "total"); json += ",\"log2\":{";
+
+            bool bFirst = true;
+
+            for (uint32_t i = 0; i < Buckets; i++)
+            {
+                if (buckets[i].Value() == 0) continue;
+
+                if (!bFirst) json += ",";
+
+                buckets[i].AppendJson(json, std::to_string(i).c_str()); bFirst = false;
+            }
+
+            json += "}}";
+        }
+    };
+
+    template <typename TSink>
+    class ScopedCycles
+    {
+        TSink& sink;
+
+        const uint64_t start;
+
+    public:
+
+        explicit ScopedCycles(TSink& sink) : sink(sink), start(__rdtsc()) {}
+
+        ~ScopedCycles()
+        {
+            sink.Add(__rdtsc() - start);
+        }
+
+        ScopedCycles(const ScopedCycles&) = delete;
+        ScopedCycles& operator=(const ScopedCycles&) = delete;
+    };
+
+    // частота TSC оценивается по steady_clock от момента создания, для перевода тактов в секунды
+    class MetricsClock
+    {
+        const uint64_t tscStart = __rdtsc();
+
+        const std::chrono::steady_clock::time_point timeStart = std::chrono::steady_clock::now();
+
+    public:
+
+        double Seconds() const
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+        }
+
+        double CyclesPerSecond() const
+        {
+            const auto seconds = Seconds();
+
+            return (seconds > 0) ? static_cast<double>(__rdtsc() - tscStart) / seconds : 0.0;
+        }
+    };
+}
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#if !defined(_WIN32)
+#include <ctime>
+#include <memory>
+#include <dirent.h>
+#endif
+
+#include "FileSystem.h"
+
+namespace MZ
+{
+    // FileEnumerator::Enumerate with a work-stealing pool of directory walkers
+    // fileAction and errorAction are called concurrently from the worker threads
+    class ParallelFileEnumerator
+    {
+    public:
+
+        using FileActionType = std::function<void(const std::wstring& path, const wchar_t* name, int64_t mt, int64_t raw_data_size)>;
+
+        using ErrorActionType = std::function<void(const std::wstring& path, const std::wstring& error)>;
+
+#if defined(_WIN32)
+        static constexpr wchar_t separator = L'\\';
+#else
+        static constexpr wchar_t separator = L'/';
+#endif
+
+        static void Enumerate(const std::wstring& prefix, const std::wstring path, FileActionType fileAction, ErrorActionType errorAction, uint32_t threads = 0)
+        {
+            mz_assert(path.size() != 0);
+
+            if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+            ParallelFileEnumerator pfe(prefix, fileAction, errorAction, threads);
+
+            const auto root = (path.back() != L'\\' && path.back() != L'/') ? path + separator : std::wstring(path);
+#if defined(_WIN32)
+            pfe.Push(0, std::wstring(root));
+#else
+            pfe.rootPath = root; pfe.Push(0, TaskType());
+#endif
+
+            std::vector<std::thread> pool;
+
+            for (uint32_t i = 1; i < threads; i++)
+            {
+                pool.emplace_back([&pfe, i]() { pfe.Run(i); });
+            }
+
+            pfe.Run(0);
+
+            for (auto& thread : pool) thread.join();
+        }
+
+    private:
+
+#if defined(_WIN32)
+        using TaskType = std::wstring;
+#else
+        // open directory, children are opened with openat relative to fd
+        struct Directory
+        {
+            int fd;
+
+            std::wstring path;
+
+            Directory(int fd, std::wstring&& path) : fd(fd), path(std::move(path)) {}
+
+            ~Directory()
+            {
+                ::close(fd);
+            }
+        };
+
+        // parent stays open while its subdirectories are queued, parent == nullptr - root
+        struct TaskType
+        {
+            std::shared_ptr<const Directory> parent;
+
+            std::string name;
+        };
+#endif
+
+        struct Worker
+        {
+            std::mutex mtx;
+
+            std::deque<TaskType> tasks;
+#if defined(_WIN32)
+            WIN32_FIND_DATA fd {};
+
+            PathHelper bp;
+#else
+            std::vector<uint8_t> buffer;
+#endif
+        };
+
+        std::vector<Worker> workers;
+
+        std::atomic<size_t> pending = 0; // directories pushed and not yet enumerated
+        std::atomic<size_t> queued = 0;  // directories waiting in the deques
+        std::atomic<uint32_t> idle = 0;
+
+        std::mutex idleMtx;
+
+        std::condition_variable idleCv;
+
+        const FileActionType& fileAction;
+
+        const ErrorActionType& errorAction;
+
+#if !defined(_WIN32)
+        std::string prefixA;
+
+        std::wstring rootPath;
+#endif
+
+        ParallelFileEnumerator(const std::wstring& prefix, const FileActionType& fa, const ErrorActionType& ea, uint32_t threads)
+            : workers(threads), fileAction(fa), errorAction(ea)
+        {
+#if defined(_WIN32)
+            for (auto& worker : workers) worker.bp.SetPrefix(prefix);
+#else
+            prefixA = WStringToAString(prefix);
+
+            for (auto& worker : workers) worker.buffer.resize(64 * 1024);
+#endif
+        }
+
+        void Push(uint32_t i, TaskType&& task)
+        {
+            pending++;
+
+            {
+                std::lock_guard<std::mutex> lock(workers[i].mtx); workers[i].tasks.push_back(std::move(task));
+            }
+
+            queued++;
+
+            if (idle.load())
+            {
+                std::lock_guard<std::mutex> lock(idleMtx); idleCv.notify_one();
+            }
+        }
+
+        // own deque LIFO (depth first, hot dentries), steal FIFO (large subtrees)
+        bool Pop(uint32_t i, TaskType& task)
+        {
+            {
+                auto& own = workers[i];
+
+                std::lock_guard<std::mutex> lock(own.mtx);
+
+                if (!own.tasks.empty())
+                {
+                    task = std::move(own.tasks.back()); own.tasks.pop_back(); queued--; return true;
+                }
+            }
+
+            for (size_t n = 1; n < workers.size(); n++)
+            {
+                auto& victim = workers[(i + n) % workers.size()];
+
+                std::lock_guard<std::mutex> lock(victim.mtx);
+
+                if (!victim.tasks.empty())
+                {
+                    task = std::move(victim.tasks.front()); victim.tasks.pop_front(); queued--; return true;
+                }
+            }
+
+            return false;
+        }
+
+        void Run(uint32_t i)
+        {
+            TaskType task;
+
+            while (true)
+            {
+                if (Pop(i, task))
+                {
+                    EnumerateDirectory(i, task);
+
+                    task = TaskType(); // releases the parent fd on Linux
+
+                    if (--pending == 0)
+                    {
+                        std::lock_guard<std::mutex> lock(idleMtx); idleCv.notify_all();
+                    }
+
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(idleMtx);
+
+                idle++;
+
+                idleCv.wait(lock, [this] { return pending.load() == 0 || queued.load() != 0; });
+
+                idle--;
+
+                if (pending.load() == 0) return;
+            }
+        }
+
+#if defined(_WIN32)
+
+        void EnumerateDirectory(uint32_t i, const std::wstring& path)
+        {
+            auto& worker = workers[i];
+
+            auto& fd = worker.fd;
+
+            HANDLE findHandle = ::FindFirstFileEx(worker.bp.c_str(path, L'*'), FindExInfoBasic, &fd, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+
+            if (findHandle == INVALID_HANDLE_VALUE)
+            {
+                const auto lastError = ::GetLastError();
+
+                errorAction(path, GetLastErrorW(lastError)); return;
+            }
+
+            do
+            {
+                if (!(fd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM)))
+                {
+                    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                    {
+                        if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+
+                        if (wcscmp(fd.cFileName, L".") != 0 && wcscmp(fd.cFileName, L"..") != 0)
+                        {
+                            Push(i, path + fd.cFileName + L'\\');
+                        }
+
+                        continue;
+                    }
+
+                    const auto size = ((uint64_t)fd.nFileSizeHigh) << 32 | fd.nFileSizeLow;
+
+                    fileAction(path, fd.cFileName, FileTimeToDecimal(fd.ftLastWriteTime), size);
+                }
+
+            } while (::FindNextFile(findHandle, &fd));
+
+            const auto lastError = ::GetLastError();
+
+            ::FindClose(findHandle);
+
+            if (lastError != ERROR_NO_MORE_FILES)
+            {
+                errorAction(path, GetLastErrorW(lastError)); return;
+            }
+        }
+
+#else
+
+        struct linux_dirent64
+        {
+            uint64_t d_ino;
+            int64_t d_off;
+            uint16_t d_reclen;
+            uint8_t d_type;
+            char d_name[1];
+        };
+
+        // invalid sequences are passed through byte by byte
+        static void FromUtf8(const char* str, std::wstring& wstr)
+        {
+            wstr.resize(0);
+
+            for (auto s = reinterpret_cast<const uint8_t*>(str); *s; )
+            {
+                uint32_t cp = *s, n = 0;
+
+                if (cp >= 0xF0 && (cp & 0xF8) == 0xF0) { cp &= 0x07; n = 3; }
+                else if ((cp & 0xF0) == 0xE0) { cp &= 0x0F; n = 2; }
+                else if ((cp & 0xE0) == 0xC0) { cp &= 0x1F; n = 1; }
+
+                uint32_t k = 1;
+
+                for (; k <= n && (s[k] & 0xC0) == 0x80; k++) cp = (cp << 6) | (s[k] & 0x3F);
+
+                if (k <= n)
+                {
+                    cp = *s; k = 1;
+                }
+
+                wstr.push_back(static_cast<wchar_t>(cp)); s += k;
+            }
+        }
+
+        // YYYYMMDDHHMMSS in UTC, as FileTimeToDecimal
+        static int64_t TimeToDecimal(int64_t seconds)
+        {
+            const std::time_t time = static_cast<std::time_t>(seconds);
+
+            std::tm tm;
+
+            if (gmtime_r(&time, &tm) == nullptr)
+            {
+                return 1900 * 10000000000ll + 100000000ll + 1000000 + 10000 + 100;
+            }
+
+            return (tm.tm_year + 1900ll) * 10000000000ll + (tm.tm_mon + 1ll) * 100000000ll + tm.tm_mday * 1000000ll
+                + tm.tm_hour * 10000ll + tm.tm_min * 100ll + tm.tm_sec;
+        }
+
+        // hidden (dot) entries and symlinks are skipped, as hidden files and reparse points on Windows
+        // the full path is converted to UTF-8 only for the root, subdirectories are opened by name
+        void EnumerateDirectory(uint32_t i, const TaskType& task)
+        {
+            auto& worker = workers[i];
+
+            std::wstring path, name;
+
+            if (task.parent)
+            {
+                FromUtf8(task.name.c_str(), name); path = task.parent->path + name + separator;
+            }
+            else path = rootPath;
+
+            constexpr int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+            const int fd = task.parent
+                ? ::openat(task.parent->fd, task.name.c_str(), flags)
+                : ::open((prefixA + WStringToAString(path)).c_str(), flags);
+
+            if (fd < 0)
+            {
+                errorAction(path, GetLastErrorW(errno)); return;
+            }
+
+            const auto directory = std::make_shared<const Directory>(fd, std::move(path));
+
+            const auto& dirPath = directory->path;
+
+            while (true)
+            {
+                const auto n = ::syscall(SYS_getdents64, fd, worker.buffer.data(), worker.buffer.size());
+
+                if (n == 0) break;
+
+                if (n < 0)
+                {
+                    errorAction(dirPath, GetLastErrorW(errno)); break;
+                }
+
+                for (long pos = 0; pos < n; )
+                {
+                    const auto de = reinterpret_cast<const linux_dirent64*>(worker.buffer.data() + pos);
+
+                    pos += de->d_reclen;
+
+                    if (de->d_name[0] == '.' || de->d_type == DT_LNK) continue;
+
+                    if (de->d_type == DT_DIR)
+                    {
+                        Push(i, TaskType{ directory, de->d_name }); continue;
+                    }
+
+                    if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+
+                    struct statx stx;
+
+                    if (::statx(fd, de->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) != 0)
+                    {
+                        FromUtf8(de->d_name, name); errorAction(dirPath + name, GetLastErrorW(errno)); continue;
+                    }
+
+                    if (S_ISDIR(stx.stx_mode))
+                    {
+                        Push(i, TaskType{ directory, de->d_name });
+                    }
+                    else if (S_ISREG(stx.stx_mode))
+                    {
+                        FromUtf8(de->d_name, name);
+
+                        fileAction(dirPath, name.c_str(), TimeToDecimal(stx.stx_mtime.tv_sec), static_cast<int64_t>(stx.stx_size));
+                    }
+                }
+            }
+        }
+
+#endif
+    };
+}
@@ -0,0 +1,491 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+
+#include "SimdHash.h"
+#include "Assert.h"
+#include "FileSystem.h"
+
+namespace MZ
+{
+    // smallKey -> skIndex for key sets larger than RAM, drop-in for hi in LargeKeyStorage (PARTITIONED_HI)
+    // старшие биты Mix(key) выбирают partition, у каждой свой SimdHash::Index и файл prefix + "hi.N"
+    // файл partition: база (keys, global, таблица Index) и дописанная за ней delta, база переписывается,
+    // только когда delta ее догоняет (Merge при загрузке), загрузка базы - чтение без хэширования ключей
+    // в памяти: summary (blocked bloom, ~1.25 B/key) и owner (1 B/key), LRU из residentLimit partitions и pending
+    // новые ключи получают skIndex сразу, а в delta partitions дописываются пачкой в Flush()
+    template <typename TIndex = uint32_t>
+    class PartitionedKeyIndex
+    {
+        using LocalIndexType = SimdHash::Index<uint64_t, SimdHash::Hash<uint64_t, SimdHash::HashType::Absl32>, SimdHash::Equal<uint64_t>, SimdHash::Mode::Fast, true>;
+
+        using PendingType = SimdHash::Map<uint64_t, TIndex, SimdHash::Hash<uint64_t, SimdHash::HashType::Absl32>>;
+
+    public:
+
+        static constexpr TIndex MAX_SIZE = SimdHash::Index<uint64_t, SimdHash::Hash<uint64_t>, SimdHash::Equal<uint64_t>, SimdHash::Mode::Fast, false, TIndex>::MAX_SIZE;
+
+    private:
+
+        // 512 бит на блок, 6 бит ключа в одном блоке, ~1% ложных попаданий при 10 битах на ключ
+        class Summary
+        {
+            std::vector<uint64_t> bits;
+
+            uint64_t blocks = 0, capacity = 0;
+
+            __forceinline size_t Block(uint64_t h, uint32_t shift) const
+            {
+                return static_cast<size_t>(__umulh(h << shift, blocks)) * 8;
+            }
+
+        public:
+
+            static constexpr uint32_t BitsPerKey = 10;
+
+            uint64_t Capacity() const
+            {
+                return capacity;
+            }
+
+            void Init(uint64_t keys)
+            {
+                capacity = keys; blocks = std::max<uint64_t>(1, (keys * BitsPerKey + 511) / 512);
+
+                bits.assign(blocks * 8, 0);
+            }
+
+            // shift: биты partition уже использованы, блок берется из следующих
+            __forceinline void Add(uint64_t h, uint32_t shift)
+            {
+                auto block = bits.data() + Block(h, shift); auto g = h * UINT64_C(11400714819323198485);
+
+                for (uint32_t i = 0; i < 6; i++, g <<= 9) block[g >> 61] |= 1ull << ((g >> 55) & 63);
+            }
+
+            __forceinline bool MayContain(uint64_t h, uint32_t shift) const
+            {
+                auto block = bits.data() + Block(h, shift); auto g = h * UINT64_C(11400714819323198485);
+
+                for (uint32_t i = 0; i < 6; i++, g <<= 9)
+                {
+                    if (!(block[g >> 61] & (1ull << ((g >> 55) & 63)))) return false;
+                }
+
+                return true;
+            }
+        };
+
+#pragma pack(push, 1)
+
+        struct DeltaRecord
+        {
+            uint64_t key;
+
+            TIndex global;
+        };
+
+#pragma pack(pop)
+
+        // файл partition: база [keys][global][таблица Index (ExportTable)], за ней DeltaRecord, дописанные в Flush
+        struct Partition
+        {
+            std::unique_ptr<LocalIndexType> index; // только resident: база + delta
+
+            std::vector<TIndex> global; // local -> skIndex по возрастанию, только resident
+
+            Summary summary;
+
+            uint32_t count = 0; // база + delta
+
+            uint32_t baseCount = 0, capacity = 0; // ключей в базе и capacity ее таблицы
+
+            uint32_t deltaCount = 0;
+
+            int64_t baseSize = 0; // байт базы в файле, delta начинается за ней
+
+            uint64_t lastUse = 0;
+        };
+
+        std::vector<Partition> partitions;
+
+        std::vector<File> files;
+
+        uint32_t partitionBits = 0, residentLimit = 0, resident = 0;
+
+        uint64_t tick = 0;
+
+        TIndex count = 0;
+
+        std::vector<uint8_t> owner; // skIndex -> partition для GetKey, 1 B/key
+
+        PendingType pending;
+
+        std::vector<uint64_t> pendingKeys; // в порядке skIndex: [count - size, count)
+
+        size_t pendingLimit = 0;
+
+        // ответы Resolve для ключей нерезидентных partitions, Absent - ключа нет; до Flush
+        PendingType resolved;
+
+        static constexpr TIndex Absent = ~TIndex(0);
+
+        // буферы Load / Flush / Resolve, чтобы не выделять память на каждую partition
+        std::vector<uint64_t> keysBuffer;
+
+        std::vector<uint8_t> tagsBuffer;
+
+        std::vector<uint32_t> realIndexBuffer;
+
+        std::vector<DeltaRecord> deltaBuffer;
+
+        std::vector<std::pair<uint32_t, uint64_t>> order;
+
+        static __forceinline uint64_t Mix(uint64_t key)
+        {
+            key ^= key >> 33; key *= UINT64_C(0xff51afd7ed558ccd);
+            key ^= key >> 33; key *= UINT64_C(0xc4ceb9fe1a85ec53);
+            key ^= key >> 33; return key;
+        }
+
+        __forceinline uint32_t PartitionOf(uint64_t h) const
+        {
+            return static_cast<uint32_t>(h >> (64 - partitionBits));
+        }
+
+        // на диске partition всегда полная, вытеснение - только освобождение памяти
+        void Evict()
+        {
+            uint32_t victim = 0; uint64_t minUse = ~0ull;
+
+            for (uint32_t i = 0; i < partitions.size(); i++)
+            {
+                if (partitions[i].index && partitions[i].lastUse < minUse)
+                {
+                    minUse = partitions[i].lastUse; victim = i;
+                }
+            }
+
+            auto& part = partitions[victim];
+
+            part.index.reset(); std::vector<TIndex>().swap(part.global);
+
+            resident--;
+        }
+
+        Partition& Acquire(uint32_t p)
+        {
+            auto& part = partitions[p]; part.lastUse = ++tick;
+
+            if (part.index) return part;
+
+            if (resident == residentLimit) Evict();
+
+            part.index = std::make_unique<LocalIndexType>();
+
+            if (part.count) Load(p);
+
+            resident++; return part;
+        }
+
+        // база без хэширования ключей (ImportTable), delta добавляется в Index по одному
+        void Load(uint32_t p)
+        {
+            auto& part = partitions[p]; auto& file = files[p];
+
+            file.SeekBegin(0);
+
+            if (part.baseCount)
+            {
+                keysBuffer.resize(part.baseCount); part.global.resize(part.baseCount);
+
+                tagsBuffer.resize(part.capacity); realIndexBuffer.resize(part.capacity);
+
+                mz_assert(file.Read(keysBuffer) == part.baseCount && file.Read(part.global) == part.baseCount
+                    && file.Read(tagsBuffer) == part.capacity && file.Read(realIndexBuffer) == part.capacity,
+                    "%s\n", file.GetLastErrorA().c_str());
+
+                const auto& keys = keysBuffer;
+
+                if (!part.index->ImportTable(part.capacity, part.baseCount, tagsBuffer.data(), realIndexBuffer.data(), [&keys](uint32_t i) { return keys[i]; }))
+                {
+                    part.index->Clear(part.count); // таблица не подошла, строим заново
+
+                    for (const auto key : keys) mz_assert(part.index->Add(key));
+                }
+            }
+
+            if (part.deltaCount == 0) return;
+
+            ReadDelta(p);
+
+            for (const auto& record : deltaBuffer)
+            {
+                mz_assert(part.index->Add(record.key)); part.global.push_back(record.global);
+            }
+
+            // delta не меньше базы: переписываем базу, рост вдвое между слияниями - запись линейна по числу ключей
+            if (part.deltaCount >= part.baseCount) Merge(p);
+        }
+
+        void ReadDelta(uint32_t p)
+        {
+            auto& part = partitions[p]; auto& file = files[p];
+
+            deltaBuffer.resize(part.deltaCount);
+
+            file.SeekBegin(part.baseSize);
+
+            mz_assert(file.Read(deltaBuffer) == part.deltaCount, "%s\n", file.GetLastErrorA().c_str());
+        }
+
+        void Merge(uint32_t p)
+        {
+            auto& part = partitions[p]; auto& file = files[p];
+
+            keysBuffer.resize(part.count);
+
+            for (uint32_t i = 0; i < part.count; i++) keysBuffer[i] = part.index->GetKey(i);
+
+            file.SeekBegin(0); file.Write(keysBuffer); file.Write(part.global);
+
+            part.index->ExportTable([&file](const void* data, size_t size)
+                {
+                    file.Write(static_cast<const byte*>(data), size);
+                });
+
+            part.baseSize = file.Position();
+
+            mz_assert(!file.IsError() && file.Truncate(), "%s\n", file.GetLastErrorA().c_str());
+
+            part.baseCount = part.count; part.capacity = part.index->Capacity(); part.deltaCount = 0;
+        }
+
+        // summary переполнен: новый вдвое больше, ключи нерезидентной partition читаются из файла без загрузки Index
+        void RebuildSummary(uint32_t p)
+        {
+            auto& part = partitions[p];
+
+            part.summary.Init(std::max<uint64_t>(part.count * 2ull, 4096));
+
+            if (part.index)
+            {
+                for (uint32_t i = 0; i < part.count; i++) part.summary.Add(Mix(part.index->GetKey(i)), partitionBits);
+
+                return;
+            }
+
+            keysBuffer.resize(part.baseCount);
+
+            files[p].SeekBegin(0);
+
+            mz_assert(files[p].Read(keysBuffer) == part.baseCount, "%s\n", files[p].GetLastErrorA().c_str());
+
+            for (const auto key : keysBuffer) part.summary.Add(Mix(key), partitionBits);
+
+            if (part.deltaCount) ReadDelta(p);
+
+            for (const auto& record : deltaBuffer) part.summary.Add(Mix(record.key), partitionBits);
+        }
+
+    public:
+
+        PartitionedKeyIndex() = default;
+
+        // по файлу на partition открыт все время, owner - байт на ключ: не больше 256 partitions
+        static constexpr uint32_t MaxPartitionBits = 8;
+
+        // prefix: каталог с '/' или пусто, файлы удаляются при закрытии
+        void Open(const std::wstring& prefix, uint32_t partitionBits = 8, uint32_t residentLimit = 16, size_t pendingLimit = 1024 * 1024)
+        {
+            mz_assert(partitions.empty() && partitionBits >= 1 && partitionBits <= MaxPartitionBits && residentLimit >= 1);
+
+            this->partitionBits = partitionBits; this->residentLimit = residentLimit; this->pendingLimit = pendingLimit;
+
+            partitions = std::vector<Partition>(1ull << partitionBits); files = std::vector<File>(partitions.size());
+
+            for (uint32_t i = 0; i < files.size(); i++)
+            {
+                const auto path = prefix + L"hi." + std::to_wstring(i);
+
+                files[i].Create(path.c_str(), false, true);
+                mz_assert(files[i].IsOpen(), "%s\n", files[i].GetLastErrorA().c_str());
+            }
+        }
+
+        TIndex Count() const
+        {
+            return count;
+        }
+
+        // как SimdHash Clear: пустой индекс, файлы partitions переиспользуются, size игнорируется
+        void Clear(TIndex size = 0)
+        {
+            for (auto& part : partitions) part = Partition();
+
+            resident = 0; count = 0; owner.resize(0);
+
+            pending.Clear(); pendingKeys.resize(0); resolved.Clear();
+        }
+
+        bool TryGetIndex(uint64_t key, TIndex& index)
+        {
+            if (pending.TryGetValue(key, index)) return true;
+
+            if (resolved.TryGetValue(key, index)) return index != Absent;
+
+            const auto h = Mix(key); const auto p = PartitionOf(h);
+
+            if (partitions[p].count == 0 || !partitions[p].summary.MayContain(h, partitionBits)) return false;
+
+            auto& part = Acquire(p);
+
+            uint32_t local;
+
+            if (!part.index->TryGetIndex(key, local)) return false;
+
+            index = part.global[local]; return true;
+        }
+
+        // пачка ключей перед TryAdd / TryGetIndex: summary-положительные ключи нерезидентных partitions
+        // группируются по partition, каждая загружается один раз, ответы лежат в resolved до Flush
+        template <typename TKeyAt>
+        void Resolve(size_t n, const TKeyAt& keyAt)
+        {
+            order.resize(0);
+
+            TIndex index;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                const uint64_t key = keyAt(i);
+
+                if (pending.TryGetValue(key, index) || resolved.TryGetValue(key, index)) continue;
+
+                const auto h = Mix(key); const auto p = PartitionOf(h); const auto& part = partitions[p];
+
+                if (part.count == 0 || part.index || !part.summary.MayContain(h, partitionBits)) continue;
+
+                order.emplace_back(p, key);
+            }
+
+            std::sort(order.begin(), order.end());
+
+            for (size_t i = 0; i < order.size(); )
+            {
+                const auto p = order[i].first;
+
+                auto& part = Acquire(p);
+
+                for (; i < order.size() && order[i].first == p; i++)
+                {
+                    uint32_t local;
+
+                    resolved.AddOrUpdate(order[i].second, part.index->TryGetIndex(order[i].second, local) ? part.global[local] : Absent);
+                }
+            }
+        }
+
+        // false и index существующего ключа, если ключ уже есть
+        bool TryAdd(uint64_t key, TIndex& index)
+        {
+            if (TryGetIndex(key, index)) return false;
+
+            mz_assert(count < MAX_SIZE);
+
+            index = count++;
+
+            pending.Add(key, index); pendingKeys.push_back(key); owner.push_back(static_cast<uint8_t>(PartitionOf(Mix(key))));
+
+            if (pendingKeys.size() >= pendingLimit) Flush();
+
+            return true;
+        }
+
+        bool Add(uint64_t key)
+        {
+            TIndex index; return TryAdd(key, index);
+        }
+
+        // медленный путь (Load, Retire): одна partition по owner
+        uint64_t GetKey(TIndex index)
+        {
+            mz_assert(index < count);
+
+            if (index >= count - pendingKeys.size()) return pendingKeys[index - (count - pendingKeys.size())];
+
+            auto& part = Acquire(owner[index]);
+
+            const auto it = std::lower_bound(part.global.begin(), part.global.end(), index);
+
+            mz_assert(it != part.global.end() && *it == index, "skIndex: %llu\n", (uint64_t)index);
+
+            return part.index->GetKey(static_cast<uint32_t>(it - part.global.begin()));
+        }
+
+        // pending дописывается в delta своих partitions, нерезидентные partitions не загружаются
+        void Flush()
+        {
+            if (pendingKeys.empty()) return;
+
+            const auto first = count - static_cast<TIndex>(pendingKeys.size());
+
+            order.resize(pendingKeys.size()); // partition, pending index
+
+            for (size_t i = 0; i < order.size(); i++) order[i] = { owner[first + i], i };
+
+            std::sort(order.begin(), order.end());
+
+            for (size_t i = 0; i < order.size(); )
+            {
+                const auto p = order[i].first;
+
+                auto& part = partitions[p]; auto& file = files[p];
+
+                deltaBuffer.resize(0);
+
+                for (; i < order.size() && order[i].first == p; i++)
+                {
+                    const auto j = static_cast<size_t>(order[i].second);
+
+                    deltaBuffer.push_back({ pendingKeys[j], static_cast<TIndex>(first + j) });
+                }
+
+                file.SeekBegin(part.baseSize + static_cast<int64_t>(part.deltaCount) * sizeof(DeltaRecord)); file.Write(deltaBuffer);
+
+                mz_assert(!file.IsError(), "%s\n", file.GetLastErrorA().c_str());
+
+                if (part.index)
+                {
+                    part.lastUse = ++tick;
+
+                    for (const auto& record : deltaBuffer)
+                    {
+                        mz_assert(part.index->Add(record.key)); part.global.push_back(record.global);
+                    }
+                }
+
+                const auto added = static_cast<uint32_t>(deltaBuffer.size());
+
+                part.deltaCount += added; part.count += added;
+
+                if (part.count > part.summary.Capacity())
+                {
+                    RebuildSummary(p);
+                }
+                else
+                {
+                    for (const auto& record : deltaBuffer) part.summary.Add(Mix(record.key), partitionBits);
+                }
+            }
+
+            pending.Clear(); pendingKeys.resize(0); resolved.Clear();
+        }
+
+        PartitionedKeyIndex(const PartitionedKeyIndex&) = delete;
+        PartitionedKeyIndex& operator=(const PartitionedKeyIndex&) = delete;
+    };
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+#include "Assert.h"
+#include "FileSystem.h"
+#include "AlignedAllocator.h"
+
+namespace MZ
+{
+    // depth aligned buffers kept in flight on the file, consumed in file order without copying
+    // replaces the single swap buffer of File::ReadOverlapped for sequential ingest
+    class ReadAheadRing
+    {
+    public:
+
+        struct Block
+        {
+            const uint8_t* data;
+
+            uint32_t size; // 0 == EOF
+
+            int64_t offset;
+        };
+
+    private:
+
+        File& file;
+
+        uint8_t* memory = nullptr;
+
+        size_t memorySize = 0;
+
+        const uint32_t depth, blockSize;
+
+        struct Slot
+        {
+            int64_t offset;
+
+            int32_t result;
+
+            bool bReady;
+        };
+
+        std::vector<Slot> slots;
+
+        uint32_t head = 0, submitted = 0;
+
+        int64_t nextOffset = 0;
+
+        bool bEof = false, bAcquired = false;
+
+        // для DataAction
+        Block current = { nullptr, 0, 0 };
+
+        uint32_t position = 0;
+
+        __inline uint8_t* Buffer(uint32_t slot) const
+        {
+            return memory + static_cast<size_t>(slot) * blockSize;
+        }
+
+        void OnComplete(uint64_t tag, int32_t result)
+        {
+            auto& slot = slots[static_cast<uint32_t>(tag)];
+
+            slot.result = result; slot.bReady = true; submitted--;
+        }
+
+        void Submit(uint32_t i)
+        {
+            slots[i] = { nextOffset, 0, false };
+
+            while (!file.SubmitRead(Buffer(i), blockSize, nextOffset, i))
+            {
+                file.Complete([this](uint64_t tag, int32_t result) { OnComplete(tag, result); });
+            }
+
+            nextOffset += blockSize; submitted++;
+        }
+
+    public:
+
+        // blockSize is rounded up to 4096 for NO_BUFFERING / O_DIRECT
+        ReadAheadRing(File& file, uint32_t depth = 8, uint32_t blockSize = 1024 * 1024)
+            : file(file), depth(depth), blockSize((blockSize + 4095) & ~4095u), slots(depth)
+        {
+            mz_assert(depth != 0 && depth <= File::defaultQueueDepth);
+
+            memorySize = static_cast<size_t>(this->depth) * this->blockSize;
+
+            memory = static_cast<uint8_t*>(AlignedBufferPool::Instance().Allocate(memorySize));
+        }
+
+        ~ReadAheadRing()
+        {
+            Stop();
+
+            AlignedBufferPool::Instance().Free(memory, memorySize);
+        }
+
+        // fills the ring from offset, the file must be open (OpenReadOverlapped on Windows)
+        void Start(int64_t offset = 0)
+        {
+            mz_assert(file.IsOpen() == true && (offset % 4096) == 0);
+
+            Stop();
+
+            nextOffset = offset; head = 0; bEof = false; bAcquired = false;
+
+            current = { nullptr, 0, 0 }; position = 0;
+
+            for (uint32_t i = 0; i < depth; i++) Submit(i);
+        }
+
+        // дожидаемся всех запросов, буферы должны оставаться живыми до завершения
+        void Stop()
+        {
+            while (submitted)
+            {
+                file.Complete([this](uint64_t tag, int32_t result) { OnComplete(tag, result); }, submitted);
+            }
+        }
+
+        // next block in file order, valid until Release()
+        Block Acquire()
+        {
+            mz_assert(bAcquired == false);
+
+            if (bEof) return { nullptr, 0, nextOffset };
+
+            auto& slot = slots[head];
+
+            while (!slot.bReady)
+            {
+                file.Complete([this](uint64_t tag, int32_t result) { OnComplete(tag, result); });
+            }
+
+            mz_assert(slot.result >= 0, "offset: %lld, error: %d\n", slot.offset, -slot.result);
+
+            if (static_cast<uint32_t>(slot.result) < blockSize) bEof = true; // короткое чтение только в конце файла
+
+            if (slot.result == 0) return { nullptr, 0, slot.offset };
+
+            bAcquired = true;
+
+            return { Buffer(head), static_cast<uint32_t>(slot.result), slot.offset };
+        }
+
+        // the acquired buffer is resubmitted for the next offset
+        void Release()
+        {
+            mz_assert(bAcquired == true);
+
+            bAcquired = false;
+
+            if (!bEof)
+            {
+                Submit(head);
+            }
+
+            head = (head + 1) % depth;
+        }
+
+        uint32_t Depth() const
+        {
+            return depth;
+        }
+
+        uint32_t BlockSize() const
+        {
+            return blockSize;
+        }
+
+        // dataAction for CDC::Zpaq::Cut, blocks are released as soon as Cut has copied them
+        std::function<uint8_t* (uint32_t seek, uint32_t& size)> DataAction()
+        {
+            return [this](uint32_t seek, uint32_t& size) -> uint8_t*
+            {
+                position += seek;
+
+                if (bAcquired && position >= current.size)
+                {
+                    Release(); current = { nullptr, 0, 0 };
+                }
+
+                if (!bAcquired)
+                {
+                    current = Acquire(); position = 0;
+
+                    if (current.size == 0)
+                    {
+                        size = 0; return nullptr;
+                    }
+                }
+
+                size = current.size - position;
+
+                return const_cast<uint8_t*>(current.data) + position;
+            };
+        }
+
+        ReadAheadRing(const ReadAheadRing&) = delete;
+        ReadAheadRing& operator=(const ReadAheadRing&) = delete;
+    };
+}
@@ -3,6 +3,7 @@
 
 #include <intrin.h>
 #include <malloc.h>
+#include <cstring>
 
 #include "Assert.h"
 
@@ -132,7 +133,8 @@ namespace MZ
             }
         };
         
-        static __forceinline uint32_t RoundUpToPowerOf2(uint32_t value)
+        template <typename T>
+        static __forceinline T RoundUpToPowerOf2(T value)
         {
             if (!value || !ResetLowestSetBit(value)) return value;
 
@@ -144,6 +146,8 @@ namespace MZ
             value |= value >> 8;
             value |= value >> 16;
 
+            if constexpr (sizeof(T) == 8) value |= value >> 32;
+
             return ++value;
         }
 
@@ -476,9 +480,9 @@ namespace MZ
                 }
             }
 
-            uint32_t size() const { return _size; }
+            uint64_t size() const { return _size; }
 
-            void AdjustSize(uint32_t size)
+            void AdjustSize(uint64_t size)
             {
                 mz_assert(size > _size);
 
@@ -493,7 +497,7 @@ namespace MZ
 
         protected:
 
-            uint32_t _size = 0;
+            uint64_t _size = 0;
 
             uint8_t* _ptr = nullptr;
         };
@@ -505,13 +509,13 @@ namespace MZ
 
             TEntry** _pages = nullptr;
 
-            uint32_t _size = 0;
+            uint64_t _size = 0;
 
             static_assert(Shift >= 10 && Shift <= 14, "Shift must be [10..14]");
 
         public:
 
-            uint32_t size() const
+            uint64_t size() const
             {
                 return _size;
             }
@@ -527,7 +531,7 @@ namespace MZ
             {
                 if (_pages)
                 {
-                    for (uint32_t i = 0; i < _size / PageSize; i++)
+                    for (uint64_t i = 0; i < _size / PageSize; i++)
                     {
                         if (_pages[i]) delete[] _pages[i];
                     }
@@ -546,7 +550,7 @@ namespace MZ
                 return _pages[index >> Shift][index & PageMask];
             }
 
-            void AdjustSize(uint32_t size)
+            void AdjustSize(uint64_t size)
             {
                 if ((size % PageSize) != 0)
                 {
@@ -561,14 +565,14 @@ namespace MZ
 
                     _pages = new TEntry * [size / PageSize];
 
-                    for (uint32_t i = 0; i < size / PageSize; i++)
+                    for (uint64_t i = 0; i < size / PageSize; i++)
                     {
                         _pages[i] = (i < old_nps) ? old_pages[i] : new TEntry[PageSize];
                     }
 
                     if (old_pages)
                     {
-                        for (uint32_t i = size / PageSize; i < old_nps; i++)
+                        for (uint64_t i = size / PageSize; i < old_nps; i++)
                         {
                             delete[] old_pages[i];
                         }
@@ -581,32 +585,120 @@ namespace MZ
             }
         };
 
-        template<typename TEntry, uint32_t Shift>
+        template<typename TEntry, uint32_t Shift, typename TIndex = uint32_t>
         class IndexArray : public EntryArray<TEntry, Shift>
         {
         public:
-            EntryArray<uint32_t, Shift> realIndex;
+            EntryArray<TIndex, Shift> realIndex;
+
+            __forceinline const auto& GetKey(uint64_t index) const
+            {
+                return (*this)[index].key;
+            }
+
+            template <typename TKey>
+            __forceinline void SetKey(uint64_t index, const TKey& key)
+            {
+                (*this)[index].key = key;
+            }
+
+            template <typename TKey, class TEqual>
+            __forceinline bool IsEqual(uint64_t index, const TKey& key, const TEqual& keyEqual) const
+            {
+                return keyEqual(key, (*this)[index].key);
+            }
+        };
+
+        // structure-of-arrays для больших ключей: первые 8 байт (prefix) в плотном массиве, остаток (tail) в отдельном
+        // на промахе по тегу читается только prefix, tail - когда prefix совпал
+        // keyEqual(a, b) должен означать равенство prefix, как у LargeKey (smallKey)
+        template<typename TKey, uint32_t Shift, typename TIndex = uint32_t>
+        class IndexArraySoA
+        {
+            static_assert(std::is_trivially_copyable_v<TKey> && sizeof(TKey) > sizeof(uint64_t), "TKey must be trivially copyable and larger than 8 bytes");
+
+            struct Tail
+            {
+                uint8_t bytes[sizeof(TKey) - sizeof(uint64_t)];
+            };
+
+            EntryArray<uint64_t, Shift> _prefix;
+
+            EntryArray<Tail, Shift> _tail;
+
+            static __forceinline uint64_t Prefix(const TKey& key)
+            {
+                uint64_t prefix; std::memcpy(&prefix, &key, sizeof(prefix)); return prefix;
+            }
+
+        public:
+            EntryArray<TIndex, Shift> realIndex;
+
+            uint64_t size() const
+            {
+                return _prefix.size();
+            }
+
+            constexpr uint32_t GetPageSize() const
+            {
+                return _prefix.GetPageSize();
+            }
+
+            void AdjustSize(uint64_t size)
+            {
+                _prefix.AdjustSize(size); _tail.AdjustSize(size);
+            }
+
+            __forceinline TKey GetKey(uint64_t index) const
+            {
+                TKey key;
+
+                std::memcpy(&key, &_prefix[index], sizeof(uint64_t));
+                std::memcpy(reinterpret_cast<uint8_t*>(&key) + sizeof(uint64_t), &_tail[index], sizeof(Tail));
+
+                return key;
+            }
+
+            __forceinline void SetKey(uint64_t index, const TKey& key)
+            {
+                _prefix[index] = Prefix(key);
+
+                std::memcpy(&_tail[index], reinterpret_cast<const uint8_t*>(&key) + sizeof(uint64_t), sizeof(Tail));
+            }
+
+            template <class TEqual>
+            __forceinline bool IsEqual(uint64_t index, const TKey& key, const TEqual& keyEqual) const
+            {
+                return _prefix[index] == Prefix(key) && keyEqual(key, GetKey(index));
+            }
         };
 
-        template <typename TKey, typename TValue, Type type>
+        template <typename TKey, typename TValue, Type type, typename TIndex, bool bSoA = false>
         struct EntryArrayType;
 
-        template <typename TKey, typename TValue>
-        struct EntryArrayType<TKey, TValue, Type::Index>
+        template <typename TKey, typename TValue, typename TIndex>
+        struct EntryArrayType<TKey, TValue, Type::Index, TIndex, false>
+        {
+            using EntryType = typename Entry<TKey, void, false>;
+            using Type = IndexArray<EntryType, 12, TIndex>;
+        };
+
+        template <typename TKey, typename TValue, typename TIndex>
+        struct EntryArrayType<TKey, TValue, Type::Index, TIndex, true>
         {
             using EntryType = typename Entry<TKey, void, false>;
-            using Type = IndexArray<EntryType, 12>;
+            using Type = IndexArraySoA<TKey, 12, TIndex>;
         };
 
-        template <typename TKey, typename TValue>
-        struct EntryArrayType<TKey, TValue, Type::Set>
+        template <typename TKey, typename TValue, typename TIndex>
+        struct EntryArrayType<TKey, TValue, Type::Set, TIndex>
         {
             using EntryType = typename Entry<TKey, TValue, false>;
             using Type = EntryArray<EntryType, 12>;
         };
 
-        template <typename TKey, typename TValue>
-        struct EntryArrayType<TKey, TValue, Type::Map>
+        template <typename TKey, typename TValue, typename TIndex>
+        struct EntryArrayType<TKey, TValue, Type::Map, TIndex>
         {
             using EntryType = typename Entry<TKey, TValue, true>;
             using Type = EntryArray<EntryType, 12>;
@@ -614,16 +706,19 @@ namespace MZ
 
         enum class Mode { Fast = 0, FastDivMod = 1, SaveMemoryFast = 2, SaveMemoryOpt = 4, SaveMemoryMax = 8, ResizeOnlyEmpty = 16 };
 
-        template <typename TKey, typename TValue, class KeyHash, class KeyEqual, Type type, Mode mode = Mode::Fast, bool bFix = false>
+        // bSoA: только для Type::Index, см. IndexArraySoA
+        template <typename TKey, typename TValue, class KeyHash, class KeyEqual, Type type, Mode mode = Mode::Fast, bool bFix = false, typename TIndex = uint32_t, bool bSoA = false>
         class Core
         {
+            static_assert(!bSoA || type == Type::Index, "SoA layout is only for Index");
+
             using TagVector = TagVectorCore;
 
             using MaskType = typename TagVector::MaskType;
 
-            using EntryType = typename EntryArrayType<TKey, TValue, type>::EntryType;
+            using EntryType = typename EntryArrayType<TKey, TValue, type, TIndex, bSoA>::EntryType;
 
-            using EntryArrayType = typename EntryArrayType<TKey, TValue, type>::Type;
+            using EntryArrayType = typename EntryArrayType<TKey, TValue, type, TIndex, bSoA>::Type;
 
             using TagArrayType = typename TagArray<TagVector>;
 
@@ -639,10 +734,11 @@ namespace MZ
 
         public:
 
-            static constexpr uint32_t MIN_SIZE = 4096;
-            static constexpr uint32_t MAX_SIZE = 0x80000000; // 0x80000000 2'147'483'648
+            static constexpr TIndex MIN_SIZE = 4096;
+            // 64-bit TIndex: 2^40 slots, the tags alone are 1TB, realIndex/entries are paged
+            static constexpr TIndex MAX_SIZE = static_cast<TIndex>((sizeof(TIndex) == 8) ? (1ull << 40) : 0x80000000); // 0x80000000 2'147'483'648
 
-            void Clear(uint32_t size = 0)
+            void Clear(TIndex size = 0)
             {
                 _Count = 0;
 
@@ -658,12 +754,12 @@ namespace MZ
                 }
             }
 
-            uint32_t Count() const
+            TIndex Count() const
             {
                 return _Count; 
             }
 
-            uint32_t Capacity() const
+            TIndex Capacity() const
             {
                 return _Capacity; 
             }
@@ -686,7 +782,7 @@ namespace MZ
 
                 if (_Capacity < MAX_SIZE)
                 {
-                    _CountGrowthLimit = static_cast<uint32_t>(static_cast<double>(_Capacity) * _max_load_factor);
+                    _CountGrowthLimit = static_cast<TIndex>(static_cast<double>(_Capacity) * _max_load_factor);
                 }
             }
 
@@ -702,15 +798,15 @@ namespace MZ
 
         private:
 
-            void RehashInternal(uint32_t size)
+            void RehashInternal(TIndex size)
             {
                 if constexpr (type == Type::Index)
                 {
                     _tags.AdjustSize(size); _tags.Init();
 
-                    for (uint32_t realIndex = 0; realIndex < _Count; realIndex++)
+                    for (TIndex realIndex = 0; realIndex < _Count; realIndex++)
                     {
-                        auto tupleIndex = _keyHash(_entries[realIndex].key);
+                        auto tupleIndex = _keyHash(_entries.GetKey(realIndex));
 
                         const auto tag = HashToTag(tupleIndex);
 
@@ -729,7 +825,7 @@ namespace MZ
 
                     const auto prevCount = _Count; _Count = 0;
 
-                    for (uint32_t i = 0; i < prevTags.size(); i++)
+                    for (uint64_t i = 0; i < prevTags.size(); i++)
                     {
                         auto prevTag = prevTags[i];
 
@@ -794,7 +890,7 @@ namespace MZ
 
         public:
 
-            void Resize(uint32_t size)
+            void Resize(TIndex size)
             {
                 if (_Capacity > AdjustCapacity(size)) return;
 
@@ -826,7 +922,7 @@ namespace MZ
 
         private:
 
-            uint32_t AdjustCapacity(uint32_t size)
+            TIndex AdjustCapacity(TIndex size)
             {
                 if (size <= MIN_SIZE) return MIN_SIZE;
                 if (size >= MAX_SIZE) return MAX_SIZE;
@@ -844,11 +940,11 @@ namespace MZ
 
                     if (new_size >= MAX_SIZE) return MAX_SIZE;
 
-                    return static_cast<uint32_t>(new_size);
+                    return static_cast<TIndex>(new_size);
                 }
                 else if constexpr (mode > Mode::FastDivMod)
                 {
-                    uint32_t ph = RoundUpToPowerOf2(size);
+                    TIndex ph = RoundUpToPowerOf2(size);
 
                     if (ph <= (16 * 1024 * 1024)) return ph;
 
@@ -859,7 +955,7 @@ namespace MZ
                         if (ph <= (64 * 1024 * 1024))
                             pi = static_cast<uint32_t>(Mode::SaveMemoryOpt);
                         else
-                            pi = pi * (ph / 1024 / 1024) / 128; // 8, 16, 32, 64
+                            pi = static_cast<uint32_t>(pi * (ph / 1024 / 1024) / 128); // 8, 16, 32, 64
                     }
 
                     for (uint32_t i = 1; i < pi; i++)
@@ -868,7 +964,7 @@ namespace MZ
                         
                         new_size = new_size / _entries.GetPageSize() * _entries.GetPageSize();
 
-                        if (size <= new_size) return static_cast<uint32_t>(new_size);
+                        if (size <= new_size) return static_cast<TIndex>(new_size);
                     }
                 }
 
@@ -896,7 +992,7 @@ namespace MZ
 
         private:
 
-            void InitCapacity(uint32_t size)
+            void InitCapacity(TIndex size)
             {
                 _Capacity = AdjustCapacity(size);
 
@@ -937,7 +1033,14 @@ namespace MZ
             template<bool bValue, typename TFunc>
             __forceinline bool FindEntry(const TKey& key, const TFunc& FUNCTION) const
             {
-                auto tupleIndex = _hasher(key);
+                return FindEntry<bValue>(key, _keyHash(key), FUNCTION);
+            }
+
+            // hash уже посчитан, см. FindEntries
+            template<bool bValue, typename TFunc>
+            __forceinline bool FindEntry(const TKey& key, const uint64_t hash, const TFunc& FUNCTION) const
+            {
+                auto tupleIndex = hash;
 
                 const TagVector target(HashToTag(tupleIndex));
 
@@ -959,7 +1062,7 @@ namespace MZ
                         {
                             const auto realIndex = _entries.realIndex[tupleIndex + TrailingZeroCount<bFix>(resultMask)];
 
-                            if (_keyeq(key, _entries[realIndex].key)) // (key == _entries[realIndex].key)
+                            if (_entries.IsEqual(realIndex, key, _keyEqual)) // (key == _entries[realIndex].key)
                             {
                                 FUNCTION(realIndex); return true;
                             }
@@ -968,7 +1071,7 @@ namespace MZ
                         {
                             const auto realIndex = tupleIndex + TrailingZeroCount<bFix>(resultMask);
 
-                            if (_keyeq(key, _entries[realIndex].key)) // (key == _entries[realIndex].key)
+                            if (_keyEqual(key, _entries[realIndex].key)) // (key == _entries[realIndex].key)
                             {
                                 FUNCTION(realIndex); return true;
                             }
@@ -979,7 +1082,7 @@ namespace MZ
 
                             const auto& entry = _entries[realIndex];
 
-                            if (_keyeq(key, entry.key)) //(key == entry.key)
+                            if (_keyEqual(key, entry.key)) //(key == entry.key)
                             {
                                 if constexpr (bValue)
                                     FUNCTION(entry.value);
@@ -1001,6 +1104,40 @@ namespace MZ
                 return false;
             }
 
+            // keyAt(i) -> const TKey&, FUNCTION(i, result) только для найденных
+            // группа ключей хешируется и подкачивается заранее, промахи кэша перекрываются
+            template<bool bValue, typename TKeyAt, typename TFunc>
+            void FindEntries(const size_t count, const TKeyAt& keyAt, const TFunc& FUNCTION) const
+            {
+                constexpr size_t GROUP = 16;
+
+                uint64_t hashes[GROUP];
+
+                for (size_t base = 0; base < count; base += GROUP)
+                {
+                    const auto size = std::min(GROUP, count - base);
+
+                    for (size_t i = 0; i < size; i++)
+                    {
+                        hashes[i] = _keyHash(keyAt(base + i));
+
+                        const auto tupleIndex = AdjustTupleIndex(hashes[i]);
+
+                        _mm_prefetch(reinterpret_cast<const char*>(_tags.data() + tupleIndex), _MM_HINT_T0);
+
+                        if constexpr (type != Type::Index)
+                        {
+                            _mm_prefetch(reinterpret_cast<const char*>(&_entries[tupleIndex]), _MM_HINT_T0);
+                        }
+                    }
+
+                    for (size_t i = 0; i < size; i++)
+                    {
+                        FindEntry<bValue>(keyAt(base + i), hashes[i], [&](const auto& result) { FUNCTION(base + i, result); });
+                    }
+                }
+            }
+
             template<bool bUnique, bool bUpdate, typename TFunc>
             __forceinline bool Add(const TKey& key, const TFunc& FUNCTION)
             {
@@ -1034,7 +1171,7 @@ namespace MZ
                             {
                                 const auto realIndex = _entries.realIndex[entryIndex];
 
-                                if (_keyEqual(key, _entries[realIndex].key))
+                                if (_entries.IsEqual(realIndex, key, _keyEqual))
                                 {
                                     if constexpr (bUpdate) FUNCTION(realIndex);
                                     
@@ -1094,7 +1231,7 @@ namespace MZ
                         _entries.AdjustSize(realIndex + 1);
                     }
 
-                    _entries[realIndex].key = key;
+                    _entries.SetKey(realIndex, key);
 
                     if constexpr (bUpdate) FUNCTION(realIndex);
                 }
@@ -1113,7 +1250,7 @@ namespace MZ
                 return true;
             }
 
-            __forceinline uint32_t FindEmpty(uint64_t tupleIndex) const
+            __forceinline TIndex FindEmpty(uint64_t tupleIndex) const
             {
                 tupleIndex = AdjustTupleIndex(tupleIndex);
 
@@ -1125,7 +1262,7 @@ namespace MZ
 
                     if (emptyMask)
                     {
-                        return static_cast<uint32_t>(tupleIndex + TrailingZeroCount<bFix>(emptyMask));
+                        return static_cast<TIndex>(tupleIndex + TrailingZeroCount<bFix>(emptyMask));
                     }
 
                     tupleIndex = AdjustTupleIndex(tupleIndex + (jump += TagVector::SIZE));
@@ -1168,7 +1305,7 @@ namespace MZ
                     }
                 }
 
-                ConstIterator(const Core* corePtr, uint32_t idx) : _corePtr(corePtr), _idx(idx), _base(idx)
+                ConstIterator(const Core* corePtr, TIndex idx) : _corePtr(corePtr), _idx(idx), _base(idx)
                 {
                     if constexpr (type == Type::Index)
                     {
@@ -1176,12 +1313,15 @@ namespace MZ
                     }
                 }
                 
-                const auto& operator*() const
+                // SoA Index отдает ключ по значению, он собирается из prefix и tail
+                decltype(auto) operator*() const
                 {
                     if constexpr (type == Type::Map)
-                        return _corePtr->_entries[_idx];
+                        return (_corePtr->_entries[_idx]);
+                    else if constexpr (type == Type::Index)
+                        return _corePtr->_entries.GetKey(_idx);
                     else
-                        return _corePtr->_entries[_idx].key;
+                        return (_corePtr->_entries[_idx].key);
                 }
 
                 ConstIterator& operator++()
@@ -1203,7 +1343,7 @@ namespace MZ
 
                 const Core* _corePtr;
 
-                uint32_t _idx, _base;
+                TIndex _idx, _base;
 
                 MaskType _mask = 0;
 
@@ -1258,27 +1398,27 @@ namespace MZ
                 Resize(MIN_SIZE);
             }
 
-            Core(uint32_t size, const KeyHash& keyHash) : _keyHash(keyHash), _keyEqual(KeyEqual())
+            Core(TIndex size, const KeyHash& keyHash) : _keyHash(keyHash), _keyEqual(KeyEqual())
             {
                 Resize(size);
             }
 
-            Core(uint32_t size, const KeyHash& keyHash, const KeyEqual& keyEqual) : _keyHash(keyHash), _keyEqual(keyEqual)
+            Core(TIndex size, const KeyHash& keyHash, const KeyEqual& keyEqual) : _keyHash(keyHash), _keyEqual(keyEqual)
             {
                 Resize(size);
             }
 
-            uint32_t _Capacity = 0, _FastModMask;
+            TIndex _Capacity = 0, _FastModMask;
             
-            uint32_t _Count = 0, _CountGrowthLimit;
+            TIndex _Count = 0, _CountGrowthLimit;
 
             uint64_t _FastModMultiplier;            
         };
 
-        template <typename TKey, typename TValue, class THash = Hash<TKey>, class TEqual = Equal<TKey>, Mode mode = Mode::Fast, bool bFix = false>
-        class Map : public Core<TKey, TValue, THash, TEqual, Type::Map, mode, bFix>
+        template <typename TKey, typename TValue, class THash = Hash<TKey>, class TEqual = Equal<TKey>, Mode mode = Mode::Fast, bool bFix = false, typename TIndex = uint32_t>
+        class Map : public Core<TKey, TValue, THash, TEqual, Type::Map, mode, bFix, TIndex>
         {
-            using core = Core<TKey, TValue, THash, TEqual, Type::Map, mode, bFix>;
+            using core = Core<TKey, TValue, THash, TEqual, Type::Map, mode, bFix, TIndex>;
 
         public:
             Map() : core() {}
@@ -1304,14 +1444,21 @@ namespace MZ
                 return core::FindEntry<true>(key, [&value](const auto& _value) { value = _value; });
             }
 
+            // batch TryGetValue: action(i, value) for every found keyAt(i), i in [0, count)
+            template <typename TKeyAt, typename TAction>
+            void TryGetValues(const size_t count, const TKeyAt& keyAt, const TAction& action) const
+            {
+                core::FindEntries<true>(count, keyAt, action);
+            }
+
             using core::Remove;
             using core::Rehash;
         };
 
-        template <typename TKey, class THash = Hash<TKey>, class TEqual = Equal<TKey>, Mode mode = Mode::Fast, bool bFix = false>
-        class Set : public Core<TKey, void, THash, TEqual, Type::Set, mode, bFix>
+        template <typename TKey, class THash = Hash<TKey>, class TEqual = Equal<TKey>, Mode mode = Mode::Fast, bool bFix = false, typename TIndex = uint32_t>
+        class Set : public Core<TKey, void, THash, TEqual, Type::Set, mode, bFix, TIndex>
         {
-            using core = Core<TKey, void, THash, TEqual, Type::Set, mode, bFix>;
+            using core = Core<TKey, void, THash, TEqual, Type::Set, mode, bFix, TIndex>;
 
         public:
             Set() : core() {}
@@ -1326,17 +1473,18 @@ namespace MZ
             using core::Rehash;
         };
 
-        template <typename TKey, class THash = Hash<TKey>, class TEqual = Equal<TKey>, Mode mode = Mode::Fast, bool bFix = false>
-        class Index : public Core<TKey, void, THash, TEqual, Type::Index, mode, bFix>
+        // bSoA: ключ хранится как prefix (8 байт) + tail, см. IndexArraySoA
+        template <typename TKey, class THash = Hash<TKey>, class TEqual = Equal<TKey>, Mode mode = Mode::Fast, bool bFix = false, typename TIndex = uint32_t, bool bSoA = false>
+        class Index : public Core<TKey, void, THash, TEqual, Type::Index, mode, bFix, TIndex, bSoA>
         {
-            using core = Core<TKey, void, THash, TEqual, Type::Index, mode, bFix>;
+            using core = Core<TKey, void, THash, TEqual, Type::Index, mode, bFix, TIndex, bSoA>;
 
         public:
             Index() : core() {}
 
-            Index(uint32_t size, const THash& hash) : core(size, hash) {}
+            Index(TIndex size, const THash& hash) : core(size, hash) {}
 
-            Index(uint32_t size, const THash& keyHash, const TEqual& keyEqual) : core(size, keyHash, keyEqual) {}
+            Index(TIndex size, const THash& keyHash, const TEqual& keyEqual) : core(size, keyHash, keyEqual) {}
 
             template<bool bUnique = false>
             __forceinline bool Add(const TKey& key)
@@ -1344,30 +1492,72 @@ namespace MZ
                 return core::Add<bUnique, false>(key, [](const auto&) {});
             }
 
-            __forceinline bool TryAdd(const TKey& key, uint32_t& index)
+            __forceinline bool TryAdd(const TKey& key, TIndex& index)
             {
                 return core::Add<false, true>(key, [&index](const auto& _index) { index = _index; });
             }
 
-            __forceinline bool TryGetIndex(const TKey& key, uint32_t& index) const
+            __forceinline bool TryGetIndex(const TKey& key, TIndex& index) const
             {
                 return core::FindEntry<false>(key, [&index](const auto& _index) { index = _index; });
             }
 
-            __forceinline uint32_t GetIndex(const TKey& key) const
+            __forceinline TIndex GetIndex(const TKey& key) const
             {
-                uint32_t index = core::Capacity();
+                TIndex index = core::Capacity();
 
                 core::FindEntry<false>(key, [&index](const auto& _index) { index = _index; });
 
                 return index;
             }
 
-            __forceinline const TKey& GetKey(uint32_t index) const
+            // const TKey& или TKey для bSoA
+            __forceinline decltype(auto) GetKey(TIndex index) const
             {
                 mz_assert(index < core::Count());
 
-                return core::_entries[index].key;
+                return core::_entries.GetKey(index);
+            }
+
+            // persistence: tags + realIndex, keys are stored by the owner and restored through keyAt(index)
+            template <typename TWrite>
+            void ExportTable(const TWrite& write) const
+            {
+                write(core::_tags.data(), core::_Capacity);
+
+                const auto pageSize = core::_entries.realIndex.GetPageSize();
+
+                for (TIndex i = 0; i < core::_Capacity; i += pageSize)
+                {
+                    write(&core::_entries.realIndex[i], static_cast<size_t>(pageSize) * sizeof(TIndex));
+                }
+            }
+
+            // no rehash, false if the table layout does not match this build (capacity/mode)
+            template <typename TKeyAt>
+            bool ImportTable(TIndex capacity, TIndex count, const uint8_t* tags, const TIndex* realIndex, const TKeyAt& keyAt)
+            {
+                core::Clear(capacity);
+
+                if (core::_Capacity != capacity || count >= core::_CountGrowthLimit) return false;
+
+                std::copy_n(tags, capacity, core::_tags.begin());
+
+                const auto pageSize = core::_entries.realIndex.GetPageSize();
+
+                for (TIndex i = 0; i < capacity; i += pageSize)
+                {
+                    std::copy_n(realIndex + i, pageSize, &core::_entries.realIndex[i]);
+                }
+
+                if (count > core::_entries.size()) core::_entries.AdjustSize(count);
+
+                for (TIndex i = 0; i < count; i++)
+                {
+                    core::_entries.SetKey(i, keyAt(i));
+                }
+
+                core::_Count = count; return true;
             }
         };
     }
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <bit>
+#include <array>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "SimdHash.h"
+
+namespace MZ
+{
+    // таблицы FragmentSketch, constexpr-функции должны быть определены до класса
+    namespace SketchTables
+    {
+        constexpr uint64_t SplitMix(uint64_t& state)
+        {
+            uint64_t z = (state += UINT64_C(0x9e3779b97f4a7c15));
+
+            z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+            z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+
+            return z ^ (z >> 31);
+        }
+
+        constexpr std::array<uint64_t, 256> MakeGear()
+        {
+            std::array<uint64_t, 256> gear{}; uint64_t state = 0x6765617248617368;
+
+            for (auto& value : gear) value = SplitMix(state);
+
+            return gear;
+        }
+
+        // a - нечетные, у разных признаков разные
+        constexpr std::array<uint64_t, 64> MakeTransforms(uint32_t features)
+        {
+            std::array<uint64_t, 64> t{}; uint64_t state = 0x536b65746368;
+
+            for (uint32_t i = 0; i < features; i++)
+            {
+                t[i * 2] = SplitMix(state) | 1; t[i * 2 + 1] = SplitMix(state);
+            }
+
+            return t;
+        }
+    }
+
+    // super-features фрагмента (N-transform, Shilane et al.): gear hash по окну 64 байта,
+    // выборка ~1/64 позиций, для каждого из Features линейных преобразований берется максимум,
+    // группы по FeaturesPerSuper признаков сворачиваются в super-feature
+    // совпадение хотя бы одного super-feature - фрагменты почти наверняка похожи
+    class FragmentSketch
+    {
+    public:
+
+        static constexpr uint32_t SuperFeatures = 3;
+
+        static constexpr uint32_t FeaturesPerSuper = 4;
+
+        static constexpr uint32_t Features = SuperFeatures * FeaturesPerSuper;
+
+        // меньше выборок - признаки шумят, такие фрагменты не ищем
+        static constexpr uint32_t MinSamples = 8;
+
+        static constexpr uint32_t SampleShift = 58; // старшие 6 бит gear hash == 0
+
+        using SuperFeaturesType = std::array<uint64_t, SuperFeatures>;
+
+        static_assert(Features * 2 <= 64, "SketchTables::MakeTransforms");
+
+    private:
+
+        static constexpr auto Gear = SketchTables::MakeGear();
+
+        static constexpr auto Transforms = SketchTables::MakeTransforms(Features);
+
+        static __forceinline uint64_t Mix(uint64_t key)
+        {
+            key ^= key >> 33; key *= UINT64_C(0xff51afd7ed558ccd);
+            key ^= key >> 33; key *= UINT64_C(0xc4ceb9fe1a85ec53);
+            key ^= key >> 33; return key;
+        }
+
+    public:
+
+        // false: фрагмент слишком мал или однороден, sf не заполнен
+        static bool Compute(const uint8_t* fragment, uint32_t fragmentSize, SuperFeaturesType& sf)
+        {
+            uint64_t features[Features] = { 0 };
+
+            uint64_t h = 0; uint32_t samples = 0;
+
+            for (uint32_t i = 0; i < fragmentSize; i++)
+            {
+                h = (h << 1) + Gear[fragment[i]];
+
+                if ((h >> SampleShift) != 0) continue;
+
+                samples++;
+
+                for (uint32_t f = 0; f < Features; f++)
+                {
+                    features[f] = std::max(features[f], h * Transforms[f * 2] + Transforms[f * 2 + 1]);
+                }
+            }
+
+            if (samples < MinSamples) return false;
+
+            for (uint32_t s = 0; s < SuperFeatures; s++)
+            {
+                uint64_t value = s;
+
+                for (uint32_t f = 0; f < FeaturesPerSuper; f++) value = Mix(value ^ features[s * FeaturesPerSuper + f]);
+
+                sf[s] = value;
+            }
+
+            return true;
+        }
+    };
+
+    // super-feature -> skIndex базового фрагмента, 0 - нет базы (skIndex 0 в hi - пустой ключ)
+    // новая база вытесняет старую: у логов и редактируемых документов ближе всего последняя версия
+    template <typename TIndex = uint32_t>
+    class SimilarityIndex
+    {
+        using MapType = SimdHash::Map<uint64_t, TIndex, SimdHash::Hash<uint64_t, SimdHash::HashType::Absl32>, SimdHash::Equal<uint64_t>, SimdHash::Mode::Fast, false, TIndex>;
+
+        MapType map;
+
+    public:
+
+        using SuperFeaturesType = FragmentSketch::SuperFeaturesType;
+
+        TIndex Count() const
+        {
+            return map.Count();
+        }
+
+        void Clear()
+        {
+            map.Clear();
+        }
+
+        // первый совпавший super-feature
+        bool TryGetBase(const SuperFeaturesType& sf, TIndex& base) const
+        {
+            for (const auto feature : sf)
+            {
+                if (map.TryGetValue(feature, base)) return true;
+            }
+
+            return false;
+        }
+
+        void Add(const SuperFeaturesType& sf, TIndex skIndex)
+        {
+            for (const auto feature : sf) map.AddOrUpdate(feature, skIndex);
+        }
+    };
+
+    // delta фрагмента к похожему базовому: copy/insert поверх хэша 8-байтных окон базы
+    // формат: varint targetSize, далее { varint literalSize, literal, varint copySize, [varint zigzag(offset - expected)] }
+    class FragmentDelta
+    {
+        static constexpr uint32_t MinMatch = 12;
+
+        static __forceinline uint8_t* PutVarInt(uint64_t value, uint8_t* out)
+        {
+            for (; value >= 0x80; value >>= 7) *out++ = static_cast<uint8_t>(value) | 0x80;
+
+            *out++ = static_cast<uint8_t>(value); return out;
+        }
+
+        static __forceinline bool GetVarInt(const uint8_t*& in, const uint8_t* end, uint64_t& value)
+        {
+            value = 0;
+
+            for (uint32_t shift = 0; in < end && shift < 64; shift += 7)
+            {
+                const uint64_t byte = *in++; value |= (byte & 0x7F) << shift;
+
+                if (byte < 0x80) return true;
+            }
+
+            return false;
+        }
+
+        static __forceinline uint64_t Read64(const uint8_t* p)
+        {
+            uint64_t value; std::memcpy(&value, p, sizeof(value)); return value;
+        }
+
+        static __forceinline uint32_t Slot(const uint8_t* p, uint32_t bits)
+        {
+            return static_cast<uint32_t>((Read64(p) * UINT64_C(0x9E3779B185EBCA87)) >> (64 - bits));
+        }
+
+    public:
+
+        // худший случай: все literal
+        static constexpr size_t MaxSize(uint32_t targetSize)
+        {
+            return targetSize + 3 * 10;
+        }
+
+        // размер delta, если он не меньше targetSize - хранить фрагмент целиком
+        static size_t Encode(const uint8_t* base, uint32_t baseSize, const uint8_t* target, uint32_t targetSize, std::vector<uint8_t>& delta)
+        {
+            delta.resize(MaxSize(targetSize));
+
+            auto out = PutVarInt(targetSize, delta.data());
+
+            const uint32_t bits = std::clamp<uint32_t>(std::bit_width(baseSize), 10, 20);
+
+            // позиция + 1, 0 - пусто; до 4 MB на поток, после Encode обнуляются только занятые слоты
+            thread_local std::vector<uint32_t> table;
+
+            if (table.size() < (1ull << bits)) table.resize(1ull << bits, 0);
+
+            for (uint32_t p = 0; p + 8 <= baseSize; p++) table[Slot(base + p, bits)] = p + 1;
+
+            uint32_t literal = 0, i = 0, expected = 0;
+
+            const auto emit = [&](uint32_t end, uint32_t copySize, uint32_t offset)
+                {
+                    out = PutVarInt(end - literal, out);
+
+                    std::memcpy(out, target + literal, end - literal); out += end - literal;
+
+                    out = PutVarInt(copySize, out);
+
+                    if (copySize)
+                    {
+                        const auto diff = static_cast<int64_t>(offset) - expected;
+
+                        out = PutVarInt((static_cast<uint64_t>(diff) << 1) ^ static_cast<uint64_t>(diff >> 63), out);
+
+                        expected = offset + copySize;
+                    }
+                };
+
+            while (i + 8 <= targetSize)
+            {
+                const auto candidate = table[Slot(target + i, bits)];
+
+                if (candidate == 0 || Read64(base + candidate - 1) != Read64(target + i))
+                {
+                    i += 1 + ((i - literal) >> 6); continue; // в несовпадающих местах шагаем быстрее
+                }
+
+                uint32_t from = candidate - 1, to = i, size = 8;
+
+                while (to + size < targetSize && from + size < baseSize && base[from + size] == target[to + size]) size++;
+
+                while (to > literal && from > 0 && base[from - 1] == target[to - 1])
+                {
+                    from--; to--; size++;
+                }
+
+                if (size < MinMatch)
+                {
+                    i++; continue;
+                }
+
+                emit(to, size, from);
+
+                i = literal = to + size;
+            }
+
+            emit(targetSize, 0, 0);
+
+            for (uint32_t p = 0; p + 8 <= baseSize; p++) table[Slot(base + p, bits)] = 0;
+
+            delta.resize(out - delta.data());
+
+            return delta.size();
+        }
+
+        // false: delta повреждена или не к этой базе
+        static bool Decode(const uint8_t* base, uint32_t baseSize, const uint8_t* delta, size_t deltaSize, std::vector<uint8_t>& target)
+        {
+            const auto end = delta + deltaSize;
+
+            uint64_t targetSize, literal, copySize, diff, expected = 0;
+
+            if (!GetVarInt(delta, end, targetSize)) return false;
+
+            target.resize(0); target.reserve(targetSize);
+
+            while (delta < end)
+            {
+                if (!GetVarInt(delta, end, literal) || literal > static_cast<uint64_t>(end - delta) || target.size() + literal > targetSize) return false;
+
+                target.insert(target.end(), delta, delta + literal); delta += literal;
+
+                if (!GetVarInt(delta, end, copySize)) return false;
+
+                if (copySize == 0) continue;
+
+                if (!GetVarInt(delta, end, diff)) return false;
+
+                const auto offset = expected + static_cast<uint64_t>(static_cast<int64_t>(diff >> 1) ^ -static_cast<int64_t>(diff & 1));
+
+                // offset + copySize может переполниться на поврежденной delta
+                if (offset > baseSize || copySize > baseSize - offset || target.size() + copySize > targetSize) return false;
+
+                target.insert(target.end(), base + offset, base + offset + copySize);
+
+                expected = offset + copySize;
+            }
+
+            return target.size() == targetSize;
+        }
+    };
+}
@@ -8,6 +8,7 @@
 #include "SimdHash.h"
 
 #include "GrowingMemoryPool.h"
+#include "FileSystem.h"
 
 template<typename CharT, size_t strSizeInBytes = 2>
 class StringStorage 
@@ -47,13 +48,15 @@ private:
     
     MZ::SimdHash::Index<const CharT*, StringHash, StringEqual> strings;
 
+    MZ::MappedFile mapped; // strings of a loaded plain file point into the view
+
     static uint32_t StringLength(const CharT* str)
     {
         const auto memory = reinterpret_cast<const char*>(str) - strSizeInBytes;
 
         if constexpr (strSizeInBytes == 1)
         {
-            *reinterpret_cast<const uint16_t*>(memory);
+            return *reinterpret_cast<const uint8_t*>(memory);
         }
         else if constexpr (strSizeInBytes == 2)
         {
@@ -61,12 +64,78 @@ private:
         }
         else if constexpr (strSizeInBytes == 3)
         {
-            *reinterpret_cast<const uint32_t*>(memory);
+            return *reinterpret_cast<const uint32_t*>(memory) & 0xFFFFFF;
         }
         else
         {
-            *reinterpret_cast<const uint32_t*>(memory);
+            return *reinterpret_cast<const uint32_t*>(memory);
+        }
+    }
+
+#pragma pack(push, 1)
+
+    struct FileHeader
+    {
+        char magic[4] = { 'M', 'Z', 'S', 'S' };
+
+        uint16_t version = 1;
+
+        uint8_t charSize = sizeof(CharT);
+        uint8_t prefixSize = strSizeInBytes;
+        uint8_t frontCoding = 0;
+
+        uint8_t reserved[23] = { 0 };
+
+        uint32_t count = 0;
+        uint32_t capacity = 0; // SimdHash::Index table
+
+        uint64_t probeHash = 0; // StringHash(Get(0)), table is reused only when the hash matches
+
+        uint64_t dataSize = 0; // data follows the header
+
+        uint64_t tableOffset = 0; // tags[capacity], realIndex[capacity]
+
+        bool IsValid() const
+        {
+            return magic[0] == 'M' && magic[1] == 'Z' && magic[2] == 'S' && magic[3] == 'S' && version == 1
+                && charSize == sizeof(CharT) && prefixSize == strSizeInBytes;
+        }
+    };
+
+#pragma pack(pop)
+
+    static_assert(sizeof(FileHeader) == 64, "sizeof(FileHeader) != 64");
+
+    // front coding restarts every FRONT_CODING_BLOCK strings
+    static constexpr uint32_t FRONT_CODING_BLOCK = 16;
+
+    // Save(path) collects small writes and passes them to the file in blocks of this size
+    static constexpr size_t WRITE_BLOCK_SIZE = 4 * 1024 * 1024;
+
+    static void PutVarInt(std::vector<uint8_t>& buffer, uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<uint8_t>(value | 0x80)); value >>= 7;
+        }
+
+        buffer.push_back(static_cast<uint8_t>(value));
+    }
+
+    static bool GetVarInt(const uint8_t*& ptr, const uint8_t* end, uint32_t& value)
+    {
+        value = 0;
+
+        for (uint32_t shift = 0; ptr < end && shift < 35; shift += 7)
+        {
+            const auto bits = *ptr++;
+
+            value |= static_cast<uint32_t>(bits & 0x7F) << shift;
+
+            if ((bits & 0x80) == 0) return true;
         }
+
+        return false;
     }
 
 public:
@@ -83,7 +152,7 @@ public:
 
         if constexpr (strSizeInBytes == 1)
         {
-            assert(len < 0xFF); *reinterpret_cast<uint16_t*>(memory) = static_cast<uint16_t>(len);
+            assert(len < 0xFF); *reinterpret_cast<uint8_t*>(memory) = static_cast<uint8_t>(len);
         }
         else if constexpr (strSizeInBytes == 2)
         {
@@ -102,8 +171,216 @@ public:
     }
 
     void Clear()
+    {
+        strings.Clear(strings.MIN_SIZE); pool.release(); mapped.Close();
+    }
+
+    // plain: records as in memory [length][chars][0], can be used in place after Load
+    // front coding: [shared][suffix length][suffix], smaller file, decoded into the pool on Load
+    template <typename TWrite>
+    void Save(const TWrite& write, bool bFrontCoding = false) const
+    {
+        FileHeader header;
+
+        header.frontCoding = bFrontCoding ? 1 : 0;
+
+        header.count = Count(); header.capacity = strings.Capacity();
+
+        if (header.count) header.probeHash = StringHash{}(Get(0));
+
+        std::vector<uint8_t> buffer;
+
+        if (bFrontCoding)
+        {
+            std::basic_string_view<CharT> prev;
+
+            for (uint32_t id = 0; id < header.count; id++)
+            {
+                const auto str = GetString(id);
+
+                uint32_t shared = 0;
+
+                if (id % FRONT_CODING_BLOCK)
+                {
+                    const auto max = static_cast<uint32_t>(std::min(prev.size(), str.size()));
+
+                    while (shared < max && prev[shared] == str[shared]) shared++;
+                }
+
+                PutVarInt(buffer, shared); PutVarInt(buffer, static_cast<uint32_t>(str.size()) - shared);
+
+                const auto suffix = reinterpret_cast<const uint8_t*>(str.data() + shared);
+
+                buffer.insert(buffer.end(), suffix, suffix + (str.size() - shared) * sizeof(CharT));
+
+                prev = str;
+            }
+
+            header.dataSize = buffer.size();
+        }
+        else
+        {
+            for (uint32_t id = 0; id < header.count; id++)
+            {
+                header.dataSize += strSizeInBytes + StringLength(Get(id)) * sizeof(CharT);
+            }
+        }
+
+        const uint64_t padding = (64 - (sizeof(FileHeader) + header.dataSize) % 64) % 64;
+
+        header.tableOffset = sizeof(FileHeader) + header.dataSize + padding;
+
+        write(&header, sizeof(header));
+
+        if (bFrontCoding)
+        {
+            write(buffer.data(), buffer.size());
+        }
+        else
+        {
+            for (uint32_t id = 0; id < header.count; id++)
+            {
+                const auto str = Get(id);
+
+                write(reinterpret_cast<const char*>(str) - strSizeInBytes, strSizeInBytes + StringLength(str) * sizeof(CharT));
+            }
+        }
+
+        const uint8_t zero[64] = { 0 };
+
+        write(zero, static_cast<size_t>(padding));
+
+        strings.ExportTable(write);
+    }
+
+    bool Save(const wchar_t* path, bool bFrontCoding = false) const
+    {
+        MZ::File file;
+
+        if (!file.Create(path, false)) return false;
+
+        std::vector<byte> buffer; buffer.reserve(WRITE_BLOCK_SIZE);
+
+        Save([&file, &buffer](const void* data, size_t size)
+            {
+                const auto bytes = static_cast<const byte*>(data);
+
+                if (buffer.size() + size > WRITE_BLOCK_SIZE && buffer.size())
+                {
+                    file.Write(buffer.data(), buffer.size()); buffer.resize(0);
+                }
+
+                if (size >= WRITE_BLOCK_SIZE)
+                {
+                    file.Write(bytes, size); return;
+                }
+
+                buffer.insert(buffer.end(), bytes, bytes + size);
+            }, bFrontCoding);
+
+        if (buffer.size()) file.Write(buffer.data(), buffer.size());
+
+        return !file.IsError();
+    }
+
+    // bInPlace: plain strings are referenced in data, the caller keeps data alive
+    bool Load(const uint8_t* data, size_t size, bool bInPlace)
     {
         strings.Clear(strings.MIN_SIZE); pool.release();
+
+        if (size < sizeof(FileHeader)) return false;
+
+        const auto& header = *reinterpret_cast<const FileHeader*>(data);
+
+        if (!header.IsValid() || header.dataSize > size - sizeof(FileHeader) || header.count > header.dataSize) return false;
+
+        const auto begin = data + sizeof(FileHeader), end = begin + header.dataSize;
+
+        std::vector<const CharT*> keys; keys.reserve(header.count);
+
+        if (header.frontCoding)
+        {
+            std::basic_string<CharT> current;
+
+            uint32_t shared, suffix;
+
+            for (auto ptr = begin; keys.size() < header.count; )
+            {
+                if (!GetVarInt(ptr, end, shared) || !GetVarInt(ptr, end, suffix)) return false;
+
+                if (shared > current.size() || static_cast<size_t>(end - ptr) < suffix * sizeof(CharT)) return false;
+
+                current.resize(shared + suffix);
+
+                std::memcpy(current.data() + shared, ptr, suffix * sizeof(CharT)); ptr += suffix * sizeof(CharT);
+
+                keys.push_back(MakeString(current.c_str()));
+            }
+        }
+        else
+        {
+            for (auto ptr = begin; keys.size() < header.count; )
+            {
+                if (static_cast<size_t>(end - ptr) <= strSizeInBytes) return false;
+
+                const auto str = reinterpret_cast<const CharT*>(ptr + strSizeInBytes);
+
+                const auto length = StringLength(str);
+
+                const auto record = strSizeInBytes + static_cast<size_t>(length) * sizeof(CharT);
+
+                // length includes the terminator, in place strings are read up to it
+                if (length == 0 || static_cast<size_t>(end - ptr) < record) return false;
+
+                CharT last; std::memcpy(&last, ptr + record - sizeof(CharT), sizeof(CharT));
+
+                if (last != 0) return false;
+
+                keys.push_back(bInPlace ? str : MakeString(str)); ptr += record;
+            }
+        }
+
+        const auto tableSize = static_cast<uint64_t>(header.capacity) * (1 + sizeof(uint32_t));
+
+        bool bTable = header.count != 0 && header.tableOffset <= size && tableSize <= size - header.tableOffset
+            && header.probeHash == StringHash{}(keys[0]);
+
+        if (bTable)
+        {
+            const auto tags = data + header.tableOffset;
+
+            bTable = strings.ImportTable(header.capacity, header.count, tags,
+                reinterpret_cast<const uint32_t*>(tags + header.capacity),
+                [&keys](uint32_t index) { return keys[index]; });
+        }
+
+        if (!bTable) // другая реализация std::hash или таблица повреждена
+        {
+            strings.Clear(strings.MIN_SIZE);
+
+            for (const auto key : keys) strings.template Add<true>(key);
+        }
+
+        return true;
+    }
+
+    bool Load(const wchar_t* path)
+    {
+        Clear();
+
+        if (!mapped.Open(path)) return false;
+
+        const bool bInPlace = mapped.size() >= sizeof(FileHeader)
+            && !reinterpret_cast<const FileHeader*>(mapped.data())->frontCoding;
+
+        if (!Load(mapped.data(), mapped.size(), bInPlace))
+        {
+            Clear(); return false;
+        }
+
+        if (!bInPlace) mapped.Close(); // front coding is decoded into the pool
+
+        return true;
     }
 
     explicit StringStorage(size_t page_size = 1024 * 1024)
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+#include "FileSystem.h"
+#include "AlignedAllocator.h"
+#include "SignalDispatcher.h"
+
+namespace MZ
+{
+    // append log with background writes, the caller only swaps its full buffer with a free slot
+    // slots are written in Push order by one thread, the file must not be used directly until Flush()
+    // writtenAction runs on the writer thread after each slot is written
+    template <typename T>
+    class WriteBehindLog
+    {
+    public:
+
+        using WrittenActionType = std::function<void()>;
+
+    private:
+
+        File& file;
+
+        std::vector<AlignedVector<T>> slots;
+
+        WrittenActionType writtenAction;
+
+        SignalDispatcher dispatcher;
+
+    public:
+
+        explicit WriteBehindLog(File& file, uint32_t depth = 2, WrittenActionType writtenAction = nullptr) : file(file), slots(depth),
+            writtenAction(std::move(writtenAction)), dispatcher([this](uint32_t id)
+                {
+                    this->file.Write(slots[id]); slots[id].resize(0);
+
+                    if (this->writtenAction) this->writtenAction();
+                }, depth)
+        {
+        }
+
+        // blocks only when all slots are still being written
+        // buffer comes back empty with at least the same capacity
+        void Push(AlignedVector<T>& buffer)
+        {
+            dispatcher.Create([&buffer, this](uint32_t id)
+                {
+                    auto& slot = slots[id];
+
+                    // емкость сохраняется, WriteToDisk добивает буфер до capacity()
+                    if (slot.capacity() < buffer.capacity()) slot.reserve(buffer.capacity());
+
+                    slot.swap(buffer);
+                });
+        }
+
+        // барьер: все отданные буферы записаны, файл можно читать и писать напрямую
+        void Flush()
+        {
+            dispatcher.Wait();
+        }
+
+        WriteBehindLog(const WriteBehindLog&) = delete;
+        WriteBehindLog& operator=(const WriteBehindLog&) = delete;
+    };
+}